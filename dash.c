@@ -6,6 +6,7 @@
 */
 
 /* include header files (examples for library usage included) */
+#define _GNU_SOURCE     // for copy_file_range(), sched_setaffinity() and execveat()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>     // for strtok() and strcmp()
@@ -14,96 +15,858 @@
 #include <sys/wait.h>   // for waitpid()
 #include <fcntl.h>      // for open()
 #include <ctype.h>      // for isstring()
+#include <limits.h>     // for PATH_MAX
+#include <sys/stat.h>   // for fstat()
+#include <sys/ioctl.h>  // for ioctl()
+#include <linux/fs.h>   // for FICLONE
+#include <dirent.h>     // for opendir()
+#include <errno.h>      // for errno
+#include <time.h>       // for clock_gettime()
+#include <sys/mman.h>   // for mmap()
+#include <sys/resource.h>   // for wait4(), setrlimit() and struct rusage
+#include <sched.h>      // for sched_setaffinity()
+#include <sys/syscall.h>    // for SYS_ioprio_set
+#include <poll.h>       // for poll()
+#include <signal.h>     // for sigaction() and killpg()
+#include <sys/socket.h> // for socketpair() and SCM_RIGHTS
+#include <sys/un.h>     // for struct sockaddr_un
+#include <sys/signalfd.h>   // for signalfd()
+#include <sys/prctl.h>  // for prctl()
+#include "dash.h"       // for struct dash_ctx and the libdash functions
 
 // BUF_SIZE was changed to 32 and 256 to test testcase-2-longcmd.txt and the output was verified to be the same in all cases
 #define BUF_SIZE 1024   // buffer size
 
+/* options set by command line flags (see parse_options) */
+struct options {
+    int auto_parallel;  // --auto-parallel: run independent batch lines concurrently
+    int explain;        // --explain: print the --auto-parallel schedule instead of running it
+    int redirect_policy;    // --redirect-policy: one of the POLICY_ values
+    int dedup;          // --dedup: run identical side-effect-free commands on a line once
+    char* cache_dir;    // --cache-dir: directory of the result cache, every redirected pure command is cached
+    long cache_size;    // --cache-size: bytes the result cache may use before old results are removed
+    int incremental;    // --incremental: skip lines whose outputs are newer than their inputs
+    char* index_file;   // --incremental=FILE: where the incremental index is kept
+    char* journal;      // --journal: file that records every finished batch line
+    int resume;         // --resume: skip lines the journal says have finished
+    int max_jobs;       // --jobs: most commands of a line running at once, 0 for no limit
+    int adaptive;       // --jobs=auto: the limit follows the load of the machine (see job_limit)
+    char* history_file; // --history: duration history file, used with --jobs
+    long mem_budget;    // --mem-budget: kilobytes the running commands of a line are predicted to use at most
+    int report;         // --report: print a timing report of every line when dash exits
+    int cpu_policy;     // --cpu-policy: one of the CPU_ values
+    char* cpu_list;     // --cpu-policy=LIST: CPUs the commands are placed on
+    double spawn_rate;  // --spawn-rate: most commands started per second, 0 for no limit
+    int progress;       // --progress: show the number of running commands on a terminal
+    int parallel;       // --parallel: run several batch files at the same time
+    char* output_dir;   // --output-dir: with --parallel, write the output of each batch file to a file here
+    long drain_timeout; // --drain-timeout: nanoseconds exit waits for the commands of its line, -1 for no limit
+    int spawn_server;   // --spawn-server: commands are forked by a small helper process
+    char* serve;        // --serve: Unix socket dash listens on for scripts to run
+    int machine;        // --machine: read JSON requests on standard input and answer each with JSON
+    char* command;      // -c: command string run like a batch file
+    char* worker;       // --worker: Unix socket dash runs the commands of other shells on
+    char* workers;      // --workers: number of local workers to start, or the sockets of running ones
+};
+
+/* how the commands of a line are placed on CPUs (--cpu-policy) */
+#define CPU_NONE    0   // left to the scheduler
+#define CPU_SPREAD  1   // 1 CPU per command, on different cores and packages first
+#define CPU_COMPACT 2   // 1 CPU per command, filling the hyperthreads of a core first
+#define CPU_LIST    3   // 1 CPU per command, taken from the list in order
+
+/* where a CPU is, read from /sys/devices/system/cpu (see init_cpu_order) */
+struct cpu_info {
+    int cpu;
+    int package;        // physical package (socket)
+    int core;           // core in the package
+    int thread;         // hyperthread of the core, 0 for the first one
+};
+
+/* timing of 1 command for --report */
+struct report_job {
+    char* command;      // the command and its arguments
+    long fork_ns;       // time fork took in the shell
+    long exec_ns;       // time from fork until the child called execv
+    long run_ns;        // time from execv until the command was waited for
+    long wait_ns;       // time the command waited for a free slot (--jobs) or an earlier command
+    long user_us;       // CPU time, see struct job
+    long system_us;
+    long max_rss;
+    int status;
+};
+
+/* timing of 1 line for --report */
+struct report_line {
+    int line;           // line number, starting at 1
+    int group;          // lines of 1 --auto-parallel group ran at the same time
+    long wall_ns;       // time from parsing the line until every command was waited for
+    int num_jobs;
+    struct report_job* jobs;
+};
+
+/* slot of the duration history, keyed by command signature (see job_signature) */
+struct history_slot {
+    unsigned long key;      // signature of the command, 0 if the slot is free
+    unsigned long duration; // average run time in nanoseconds
+    unsigned int runs;      // number of runs averaged
+    unsigned int max_rss;   // peak resident set size in kilobytes, 0 if unknown
+};
+
+/* the history file is the 8 byte header DASHHIS1 and a hash table of slots that is
+mapped into memory and shared by every dash using the file */
+#define HISTORY_SLOTS 4096
+#define HISTORY_PROBES 16
+struct history_file {
+    char magic[8];
+    struct history_slot slots[HISTORY_SLOTS];
+};
+
+/* record of the --journal file, written when a line has finished */
+struct journal_entry {
+    unsigned int line;      // line number in the batch file, starting at 1
+    int status;             // status returned by process
+    unsigned long text;     // hash of the command text (see hash_line)
+    unsigned long duration; // nanoseconds the line took
+};
+
+/* the journal is synced after this many records or this many nanoseconds,
+so a crash loses at most the last group of records but lines do not wait for the disk */
+#define JOURNAL_SYNC_RECORDS 64
+#define JOURNAL_SYNC_NS 1000000000L
+
+/* entry of the --incremental index: the command text that last produced an output file */
+struct fresh_entry {
+    unsigned long target;   // hash of the normalized path of the output file
+    unsigned long text;     // hash of the command text (see hash_line)
+};
+
+/* counters shown by cache stats */
+struct cache_stats {
+    int hits;
+    int misses;
+    int stores;
+    int evictions;
+};
+
+/* resource limits set by the limit prefix and the ulimit built-in command */
+struct limit_info {
+    char* name;
+    int resource;       // RLIMIT_ constant
+    int is_size;        // 1 if the value is a size (ex. 512M), 0 if it is a number
+};
+
+#define NUM_LIMITS 5
+struct limit_info limit_names[NUM_LIMITS] = {
+    {"cpu",    RLIMIT_CPU,    0},   // seconds of CPU time
+    {"mem",    RLIMIT_AS,     1},   // bytes of address space
+    {"nofile", RLIMIT_NOFILE, 0},   // open files
+    {"nproc",  RLIMIT_NPROC,  0},   // processes of the user
+    {"fsize",  RLIMIT_FSIZE,  1}    // bytes a file may grow to
+};
+
+/* an absolute directory of the current path, opened by open_path_dirs */
+struct path_dir {
+    char* name;         // directory as written in the path command
+    int fd;             // O_PATH descriptor of the directory, -1 if it cannot be opened
+};
+
+/* a command forked by the shell, waited for by wait_local */
+struct child {
+    pid_t pid;
+    int pidfd;          // readable once the command has exited, -1 if pidfd_open failed
+};
+
+/* request from the shell to the --spawn-server helper to start 1 command. it is
+followed by the argv, path and semaphore name of the job as NUL terminated strings, and
+carries standard input, output and error, then the directory and the --report pipe of
+the job if it has them, as SCM_RIGHTS descriptors */
+struct spawn_request {
+    int redirection;
+    int has_cpus;
+    cpu_set_t cpus;
+    int limit_set;
+    rlim_t limits[NUM_LIMITS];
+    int has_nice;
+    int nice;
+    int ioprio;
+    int sem_slots;
+    pid_t pgid;         // process group of the line, 0 to start a new one
+    int owns_terminal;
+    int num_args;       // strings in the argv of the job
+    int num_path;       // strings in the path of the job
+    int has_sem;        // 1 if the semaphore name follows the path
+    int has_dir;        // 1 if the directory of the job is sent
+    int has_report;     // 1 if the --report pipe is sent
+};
+
+/* message from the --spawn-server helper to the shell */
+struct spawn_reply {
+    int type;           // SPAWN_STARTED or SPAWN_EXITED
+    pid_t pid;          // pid of the command, -1 if fork failed
+    pid_t pgid;         // SPAWN_STARTED: process group the command joined
+    int error;          // SPAWN_STARTED: errno of fork if it failed
+    int status;         // SPAWN_EXITED: status returned by wait4
+    struct rusage usage;    // SPAWN_EXITED: resources used by the command
+};
+
+#define SPAWN_STARTED   0   // answer to a spawn_request
+#define SPAWN_EXITED    1   // a command started by the helper has been waited for
+#define SPAWN_MSG_MAX   65536   // largest spawn_request with its strings
+#define SPAWN_FDS       5   // most descriptors sent with a spawn_request
+
+/* a --serve client whose script is running */
+struct serve_client {
+    pid_t pid;          // shell running the script
+    int conn;           // connection the reply is sent on
+    long start;         // time the connection was accepted
+};
+
+/* message between the shell and a --worker, 1 SOCK_SEQPACKET packet. WORKER_RUN is
+followed by a spawn_request with its strings and the directory of the command, and
+WORKER_OUTPUT by the bytes the command wrote */
+struct worker_msg {
+    int type;           // one of the WORKER_ values
+    int id;             // command the message is about (see worker_start)
+    int value;          // slots (HELLO), 1 or 2 for standard output or error (OUTPUT), status (EXITED) or signal (KILL)
+    struct rusage usage;    // WORKER_EXITED: resources used by the command
+};
+
+#define WORKER_HELLO    0   // sent by a worker when a shell connects
+#define WORKER_RUN      1   // the shell gives a worker a command
+#define WORKER_OUTPUT   2   // a command wrote to its standard output or error
+#define WORKER_EXITED   3   // a command has finished and all of its output was sent
+#define WORKER_KILL     4   // the shell sends a signal to the commands it gave the worker
+#define WORKER_IDS      (1 << 22)   // ids of worker commands start above the largest pid_max
+
+/* a --worker the shell sends commands to */
+struct worker {
+    char* name;         // socket of the worker, abstract if it starts with @
+    int fd;             // connection to the worker, -1 if it has gone away
+    int slots;          // commands the worker runs at once
+    int queued;         // commands sent to it that have not finished
+    int* ids;           // ids of those commands
+};
+
+/* a command a worker was given */
+struct worker_cmd {
+    int id;             // id the shell gave the command
+    char* request;      // the WORKER_RUN message until the command starts, then NULL
+    pid_t pid;          // pid of the command, 0 before it starts
+    int out;            // pipe of its standard output, -1 once closed
+    int err;            // pipe of its standard error, -1 once closed
+    int status;         // status returned by wait4, -1 until it has been waited for
+    struct rusage usage;    // resources used by the command
+};
+
+/* I/O priority for ioprio_set, which has no glibc wrapper (see linux/ioprio.h) */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT    1    // realtime, levels 0 (highest) to 7
+#define IOPRIO_CLASS_BE    2    // best-effort, the default class
+#define IOPRIO_CLASS_IDLE  3    // only gets the disk when nobody else uses it
+
+/* one command of an input line. a line with & has 1 job per command */
+struct job {
+    char** argv;        // tokenized command, NULL terminated
+    int redirection;    // 1 if output is redirected to a file (see check_redirect)
+    pid_t pid;          // pid of the running command, -1 if it was not started
+    int state;          // JOB_PENDING, JOB_RUNNING or JOB_DONE
+    long queued;        // time the command was ready to start (see now_ns)
+    long start;         // time the command was started
+    long forked;        // time fork returned in the shell
+    long execed;        // time the child was about to call execv, 0 if unknown
+    long end;           // time the command was waited for
+    long user_us;       // user CPU time of the command in microseconds
+    long system_us;     // system CPU time of the command in microseconds
+    long max_rss;       // peak resident set size of the command in kilobytes
+    long predicted;     // run time the duration history predicts, -1 if unknown
+    long predicted_rss; // peak memory in kilobytes the history predicts, -1 if unknown
+    int after;          // index of a job that must finish before this one starts, -1 if none
+    int skip;           // 1 if the job is not run
+    int dup_of;         // index of an identical job whose result this job shares, -1 if none
+    int generation;     // number of cd and path commands before the job on its line
+    int status;         // exit status of the command once it has finished
+    int cache;          // 1 if the output may come from or go to the result cache
+    char** inputs;      // files declared with cache -i, NULL terminated (points into argv)
+    char** cache_env;   // environment variables selected with cache -e, NULL terminated
+    unsigned long cache_key;    // key of the result in the cache, 0 if it is not stored
+    char* cache_target; // absolute path of the redirection target to store in the cache
+    int has_cpus;       // 1 if the command runs on the CPUs in cpus
+    cpu_set_t cpus;     // CPUs from the affinity prefix or --cpu-policy
+    int cpu;            // index in cpu_order given by --cpu-policy, -1 if none
+    int limit_set;      // bit i is set if limits[i] applies (see limit_names)
+    rlim_t limits[NUM_LIMITS];  // resource limits from the limit prefix
+    int has_nice;       // 1 if nice is added to the niceness of the command
+    int nice;           // from the nice prefix
+    int ioprio;         // I/O priority from the ionice prefix, -1 if none
+    int dir_fd;         // directory the command runs in (see scope_dirs), -1 for the shell's
+    char** path;        // path the command is searched in, set by scope_dirs (for path, the path it replaces)
+    char* sem_name;     // semaphore from the sem prefix, NULL if none (points into argv)
+    int sem_slots;      // most holders of the semaphore at once
+    char* error;        // error code reported by --machine (see line_error), NULL if none
+};
+
+/* a way of starting commands (see exec_command) */
+struct backend {
+    char* name;
+    pid_t (*start)(struct job* job, char** path);   // starts a command, returns its pid or -1 with errno set
+    pid_t (*wait)(int* status, struct rusage* usage, int options);  // like wait4 for the commands it started
+    void (*kill)(int sig);      // sends a signal to the commands of the line, called from a signal handler
+    int shell_groups;   // 1 if the shell puts the commands in the process group of the line
+};
+
+/* state of the --jobs=auto controller. the pressure files are read at most once per
+PRESSURE_REFRESH_NS, and each new sample moves the limit once: it is halved when memory
+is short (stalls above PRESSURE_MEM_HIGH percent or less than PRESSURE_MEM_FREE percent
+of memory available) or CPU stalls are above PRESSURE_CPU_HIGH percent, and raised by 1
+while commands wait for the limit and CPU stalls are below PRESSURE_CPU_LOW percent */
+#define PRESSURE_REFRESH_NS 250000000L
+#define PRESSURE_MEM_HIGH 5.0
+#define PRESSURE_MEM_FREE 10
+#define PRESSURE_CPU_HIGH 80.0
+#define PRESSURE_CPU_LOW 20.0
+struct pressure {
+    long sampled;       // time of the last sample, 0 before the first
+    long cpu_total;     // total stall microseconds read from /proc/pressure/cpu
+    long mem_total;     // total stall microseconds read from /proc/pressure/memory
+    double cpu_some;    // percent of the last interval some task waited for a CPU
+    double mem_some;    // percent of the last interval some task waited for memory
+    long available_kb;  // MemAvailable from /proc/meminfo
+    long memory_kb;     // MemTotal from /proc/meminfo
+    int limit;          // current limit, 0 before the first sample
+    int held_back;      // 1 if a command waited for the limit since the last sample
+};
+
+/* a fork that fails because the system is out of processes or memory is retried
+after a running command finishes or, if none is running, after a delay that doubles
+from FORK_BACKOFF_NS up to FORK_BACKOFF_MAX_NS. the command fails after FORK_RETRIES retries */
+#define FORK_RETRIES 10
+#define FORK_BACKOFF_NS 1000000L
+#define FORK_BACKOFF_MAX_NS 500000000L
+
+/* states of a job */
+#define JOB_PENDING 0       // not started yet
+#define JOB_RUNNING 1       // started and not waited for
+#define JOB_DONE    2       // finished (or did not need to run) and its status is set
+
+/* what happens when commands on one line redirect to the same file (--redirect-policy) */
+#define POLICY_SERIALIZE 0  // run them one after the other in line order
+#define POLICY_ERROR     1  // report an error and only run the first one
+#define POLICY_LAST      2  // only run the last one, since it would overwrite the others
+
+#define CACHE_NAME_MAX 48   // room for /.tmp.PID.KEY after the path of the cache directory
+
+/* a cached result, used to evict the least recently used ones first */
+struct cache_entry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    time_t used;
+};
+
+/* what one input line reads and writes, inferred by analyze_line */
+struct line_deps {
+    char** reads;       // normalized paths the line reads
+    int num_reads;
+    char** writes;      // normalized paths the line writes
+    int num_writes;
+    char* barrier;      // name of the command that makes the line a barrier, NULL if none
+    char* unknown;      // first command not in known_commands, which may write any file
+                        // (strdup, NULL if none)
+};
+
+/* flags describing what a well-known external command does with its arguments */
+#define CMD_PURE       1    // only writes to standard output, has no other side effects
+#define CMD_READS_ARGS 2    // file arguments are only read
+#define CMD_READS_CWD  4    // reads the current directory when given no file arguments
+#define CMD_ALONE      8    // observes other processes, so it never runs alongside other lines
+
+struct cmd_info {
+    char* name;
+    int flags;
+};
+
+/* commands not listed here may write any file, so --auto-parallel runs them alone.
+incremental assumes they read and write their file arguments and read the current directory */
+struct cmd_info known_commands[] = {
+    {"echo",     CMD_PURE},
+    {"pwd",      CMD_PURE},
+    {"uname",    CMD_PURE},
+    {"date",     CMD_PURE},
+    {"whoami",   CMD_PURE},
+    {"hostname", CMD_PURE},
+    {"sleep",    CMD_PURE},
+    {"true",     CMD_PURE},
+    {"false",    CMD_PURE},
+    {"cat",      CMD_PURE | CMD_READS_ARGS},
+    {"head",     CMD_PURE | CMD_READS_ARGS},
+    {"tail",     CMD_PURE | CMD_READS_ARGS},
+    {"wc",       CMD_PURE | CMD_READS_ARGS},
+    {"grep",     CMD_PURE | CMD_READS_ARGS},
+    {"sort",     CMD_PURE | CMD_READS_ARGS},
+    {"diff",     CMD_PURE | CMD_READS_ARGS},
+    {"cmp",      CMD_PURE | CMD_READS_ARGS},
+    {"md5sum",   CMD_PURE | CMD_READS_ARGS},
+    {"stat",     CMD_PURE | CMD_READS_ARGS},
+    {"file",     CMD_PURE | CMD_READS_ARGS},
+    {"ls",       CMD_PURE | CMD_READS_ARGS | CMD_READS_CWD},
+    {"du",       CMD_PURE | CMD_READS_ARGS | CMD_READS_CWD},
+    {"find",     CMD_PURE | CMD_READS_ARGS | CMD_READS_CWD},
+    {"ps",       CMD_PURE | CMD_ALONE},
+    {"rm",       0},
+    {"cp",       0},
+    {"mv",       0},
+    {"touch",    0},
+    {"mkdir",    0},
+    {"rmdir",    0},
+    {"ln",       0},
+    {"chmod",    0}
+};
+
+/* a built-in command registered with dash_register_builtin */
+struct dash_builtin {
+    char* name;
+    dash_builtin_fn fn;
+    void* data;         // given to fn
+};
+
+/* a shell (see dash.h). main runs 1, a program using libdash may run several, so
+everything a line changes is kept here. what belongs to the process (the signal being
+forwarded, the terminal, the backend and its helpers) is global */
+struct dash_ctx {
+    int exit_not_called;        // 0 once the exit built-in command has run
+    char** path;                // directories commands are searched in, NULL terminated (strdup)
+    struct dash_builtin* builtins;  // built-in commands added with dash_register_builtin
+    int num_builtins;
+    int last_status;            // $? : status of the last line (see process)
+    long last_user_us;          // $UTIME and $STIME : CPU time of the commands of the last line
+    long last_system_us;
+    long last_max_rss;          // $MAXRSS : largest peak memory of a command of the last line
+    char var_status[16];        // the values expand_vars puts in the tokens of a line
+    char var_utime[32];
+    char var_stime[32];
+    char var_maxrss[32];
+    int last_line;              // 1 while the last line of a batch file or -c string runs (see can_tail_exec)
+    int no_exec;                // 1 if the process must not be replaced: dash_eval and --machine (see dash_exec)
+    struct options opt;         // command line options, none for a libdash shell
+    int current_line;           // line number of the line being run
+    int running_jobs;           // commands started and not waited for yet
+    pid_t line_pgid;            // process group of the commands of the line, 0 before the first starts
+    struct child* children;     // commands forked by the shell and not waited for yet
+    int num_children;
+    char* line_error;           // --machine: first error code of the request being run, NULL if none
+    char* machine_jobs;         // --machine: JSON array of the commands of the request (see machine_add)
+    char** pure_commands;       // commands the user marked as side-effect-free with pure (strdup)
+    int num_pure_commands;
+    struct path_dir* path_dirs; // absolute directories of path, see open_path_dirs
+    int num_path_dirs;
+    struct cache_stats cache_counts;
+    struct fresh_entry* fresh_index;    // --incremental index loaded by load_index
+    int fresh_size;
+    struct history_file* history;   // duration history mapped by open_history
+    int journal_fd;             // --journal file, opened by open_journal
+    struct journal_entry* finished;     // records read from the journal for --resume
+    int num_finished;
+    int unsynced;               // records written since the last fdatasync
+    long last_sync;             // time of the last fdatasync
+    struct report_line* report_lines;   // lines recorded for --report
+    int num_report_lines;
+    int num_report_groups;
+    int report_fds[2];          // pipe children write the time they call execv to
+    long report_start;          // time dash started
+    int* cpu_order;             // CPUs in the order --cpu-policy hands them out
+    int num_cpu_order;
+    double spawn_tokens;        // commands --spawn-rate lets start now (see wait_for_token)
+    long spawn_refill;          // time spawn_tokens was last refilled
+    int spawned;                // commands started, shown by --progress
+    int fork_retries;           // forks that failed and were retried
+    long progress_shown;        // time --progress was last drawn
+    struct pressure pressure;   // --jobs=auto controller (see job_limit)
+};
+
 /* function declarations */
 char* read_input();
-void process(char* input, char*** path);
+int process(char* input, struct dash_ctx* ctx);
+int run_line(char* input, int line_number, struct dash_ctx* ctx);
 int check_empty_input(char* input);
 char** parse_input(char* input);
 char** parse_cmds(char* input);
-pid_t exec_command(char** arrTok, char** path, int redirection);
-void wait_for_cmds(pid_t pid[], int parallel_cmd);
+pid_t exec_command(struct job* job, char** path);
+void exec_child(struct job* job, char** path, int group);
+int exec_in_dir(int dir_fd, char* dir, char* name, char** argv);
+void wait_for_cmds(struct job jobs[], int num_jobs);
+void reap_one(struct job jobs[], int num_jobs);
+void finish_job(struct job* job, int status, struct rusage* usage);
+void launch_jobs(struct job jobs[], int num_jobs, int first, int last);
+int start_job(struct job* job);
+int scope_dirs(struct job jobs[], int num_jobs, char*** path, int dir_fds[]);
+void wait_for_token();
+int job_limit();
+void sample_pressure();
+long read_stall(char* file);
+void show_progress(int force);
 void write_error();
 int check_command(char** arrTok);
 int check_parallel(char* input);
 int check_redirect(char* input);
 int check_path(char** arrTok);
-void dash_exit(char** arrTok);
-void dash_exit2(char** arrTok, int parallel_cmd, pid_t pid[]);
-void dash_cd(char** arrTok);
+void dash_exit(struct dash_ctx* ctx, char** arrTok);
+void dash_exit2(struct dash_ctx* ctx, char** arrTok, struct job jobs[], int num_jobs);
+int dash_cd(char** arrTok, int dir_fd);
 char** dash_path(char** arrTok);
+void free_path(char** path);
+int path_dir_fd(char* dir);
+void open_path_dirs(struct dash_ctx* ctx, char** path);
+void close_path_dirs(struct dash_ctx* ctx);
 int count_tokens(char** arr);
-void which_built_in(char** arrTok, int parallel_cmd, pid_t pid[]);
+int which_built_in(struct dash_ctx* ctx, char** arrTok, struct job jobs[], int num_jobs);
+struct dash_builtin* find_builtin(struct dash_ctx* ctx, char* name);
+int parse_options(int argc, char* argv[], char* files[]);
+char* option_value(int argc, char* argv[], int* i, char* name);
+void run_auto_parallel(FILE* input_file, struct dash_ctx* ctx);
+void analyze_line(char* input, char* cwd, struct line_deps* deps);
+void add_dep(char*** set, int* count, char* cwd, char* file);
+char* normalize_path(char* cwd, char* file);
+int paths_overlap(char* a, char* b);
+char* find_conflict(struct line_deps* a, struct line_deps* b);
+void free_deps(struct line_deps* deps);
+void run_group(char** lines, int first_line, int num_lines, struct dash_ctx* ctx);
+void copy_output(FILE* from, int to);
+void check_write_conflicts(struct job jobs[], int num_jobs);
+int same_target(struct stat* a, char* name_a, struct stat* b, char* name_b);
+void dedup_jobs(struct job jobs[], int num_jobs);
+int same_tokens(char** a, char** b);
+int same_prefixes(struct job* a, struct job* b);
+int writes_target(struct job* job, char* target);
+int is_pure(char* command);
+int command_flags(char* command);
+void dash_pure(char** arrTok);
+void init_job(struct job* job);
+int parse_prefixes(struct job* job);
+long parse_size(char* value);
+char* cache_dir();
+unsigned long hash_bytes(unsigned long hash, void* data, size_t len);
+unsigned long hash_string(unsigned long hash, char* str);
+unsigned long cache_key(struct job* job, char** path);
+int cache_lookup(struct job* job, char** path);
+void cache_store(struct job* job);
+int compare_entries(const void* a, const void* b);
+void cache_evict(char* dir);
+int is_cache_entry(char* name);
+int clone_file(int from, int to);
+void dash_cache(char** arrTok);
+unsigned long hash_line(char* input);
+int line_is_fresh(char* input);
+void record_fresh(char* input);
+void load_index();
+void save_index();
+long now_ns();
+void open_journal();
+int journal_done(char* input, int line_number);
+void journal_record(char* input, int line_number, int status, long duration);
+void sync_journal();
+char* dash_dir();
+void open_history();
+struct history_slot* history_find(unsigned long key, int create);
+unsigned long job_signature(struct job* job);
+long history_predict(struct job* job);
+long history_predict_rss(struct job* job);
+int fits_budget(struct job jobs[], int num_jobs, struct job* job);
+void history_record(struct job* job, long duration);
+void report_open_pipe();
+void report_exec();
+void report_add(struct job jobs[], int num_jobs, long line_start);
+void report_add_line(char* input, int line_number, int group, long wall, int status);
+void print_report();
+int parse_cpu_list(char* list, cpu_set_t* set);
+void init_cpu_order();
+int compare_spread(const void* a, const void* b);
+int compare_compact(const void* a, const void* b);
+void assign_cpu(struct job jobs[], int num_jobs, int k);
+void dash_affinity(char** arrTok);
+int parse_limit(char* setting, int* index, rlim_t* value);
+int parse_ioprio(char* value, int* ioprio);
+int sem_acquire(char* name, int slots);
+void sem_file(char* name, char* file, size_t size);
+void init_state(char* batch_file);
+void run_batch(char* file_name, struct dash_ctx* ctx);
+void run_stream(FILE* input_file, struct dash_ctx* ctx);
+void run_scripts(char* files[], int num_files, struct dash_ctx* ctx);
+void write_prefixed(int to, char* prefix, char* data, size_t len);
+void join_group(pid_t pid);
+void forward_signal(int sig);
+void init_signals(int interactive);
+void drain_jobs(struct job jobs[], int num_jobs, long deadline);
+void dash_ulimit(char** arrTok);
+int dash_exec(struct dash_ctx* ctx, char** arrTok, struct job jobs[], int num_jobs);
+int can_tail_exec(struct dash_ctx* ctx, struct job jobs[], int num_jobs, int k);
+void expand_vars(struct dash_ctx* ctx, char** arrTok);
+void start_spawn_server();
+void spawn_server(int sock);
+pid_t spawn_remote(struct job* job, char** path);
+pid_t wait_cmd(int* status, struct rusage* usage, int options);
+pid_t fork_command(struct job* job, char** path);
+pid_t wait_local(int* status, struct rusage* usage, int options);
+void add_child(pid_t pid);
+void remove_child(int k);
+pid_t wait_spawn(int* status, struct rusage* usage, int options);
+void kill_group(int sig);
+void spawn_close();
+void add_exit(pid_t pid, int status, struct rusage* usage);
+size_t pack_request(struct job* job, char** path, char* buf, size_t size);
+char* unpack_request(struct spawn_request* req, struct job* job, char** argv, char** path);
+void start_workers();
+void add_worker(char* name);
+int worker_addr(char* name, struct sockaddr_un* addr);
+int worker_listen(char* name);
+void worker_daemon(int listen_fd);
+void worker_serve(int conn);
+void worker_run(struct worker_cmd* cmd);
+void connect_workers();
+int connect_worker(char* name, int* slots);
+pid_t worker_start(struct job* job, char** path);
+int dir_name(int dir_fd, char* buf, size_t size);
+pid_t worker_read(int k, int* status, struct rusage* usage);
+void worker_lost(int k);
+pid_t worker_wait(int* status, struct rusage* usage, int options);
+void worker_kill(int sig);
+void serve(char* sock_path, struct dash_ctx* ctx);
+void serve_script(int conn, struct dash_ctx* ctx);
+int read_full(int fd, void* buf, size_t len);
+char* job_command(struct job* job);
+void run_machine(struct dash_ctx* ctx);
+int parse_request(char* text, char** id, char** line);
+char* json_value(char** text, int decode);
+void json_string(FILE* out, char* str, size_t len);
+void json_output(FILE* out, FILE* file);
+void machine_add(struct job jobs[], int num_jobs);
 
-int exit_not_called = 1;        // initialize exit as not called
+__thread struct dash_ctx* shell = NULL;    // shell whose line is running (see main and dash_eval)
 char* built_in_commands[] = {   // char pointer array listing built-in commands
     "exit",
     "cd",
-    "path"
+    "path",
+    "pure",
+    "cache",
+    "affinity",
+    "ulimit",
+    "exec"
 };
+int owns_terminal = 0;          // 1 if the commands of a line are given the terminal (see init_signals)
+int interactive_shell = 0;      // 1 in interactive mode, where an interrupted line does not end the shell
+volatile sig_atomic_t interrupted = 0;  // signal forwarded to the commands of the line, 0 if none
+pid_t shell_pid;                // pid of the shell, exit handlers do nothing in forked children
+int spawn_fd = -1;              // socket to the --spawn-server helper, -1 if commands are forked here
+struct spawn_reply* spawn_exits = NULL;    // commands a backend reported finished before the shell waited (see add_exit)
+int num_spawn_exits = 0;
+struct backend local_backend = {"fork", fork_command, wait_local, kill_group, 1};
+struct backend spawn_backend = {"spawn-server", spawn_remote, wait_spawn, kill_group, 0};
+struct backend worker_backend = {"workers", worker_start, worker_wait, worker_kill, 0};
+struct backend* backend = &local_backend;  // how commands are started (see exec_command)
+struct worker* workers = NULL;  // --workers commands are sent to
+int num_workers = 0;
+pid_t workers_owner = 0;        // process the connections to the workers belong to
+int worker_ids = WORKER_IDS;    // id of the last command sent to a worker
+char* jobs_sem = NULL;          // semaphore shared by the --parallel batch files for --jobs
 
+#ifndef LIBDASH
 int main(int argc, char *argv[])
 {
-    char** path = malloc(sizeof(char*));    // allocate memory for path variable
-    path[0] = "/bin";                       // initialize initial shell path directory
+    // a closed standard descriptor (dash> cmd > file runs cmd with stderr closed) goes to
+    // /dev/null, otherwise a path directory or a file dash opens would take its number
+    // and be replaced when a command is redirected
+    int std_fd;
+    for (std_fd = STDIN_FILENO; std_fd <= STDERR_FILENO; std_fd++) {
+        if (fcntl(std_fd, F_GETFD) == -1) {
+            open("/dev/null", O_RDWR);
+        }
+    }
+    struct dash_ctx* ctx = dash_ctx_new();  // the shell, with /bin as its path
+    if (!ctx) {
+        write_error();
+        exit(1);
+    }
+    shell = ctx;
     
-    /* argc is how many command line arguments are passed to run program
-    ./dash --> argc = 1 (no argument)
-    ./dash batch.txt --> argc = 2 (1 argument)
-    anything else is an error */
-    if (argc == 1) {
+    /* options (arguments starting with --) are removed and the rest are batch files
+    ./dash --> num_files = 0 (no argument)
+    ./dash batch.txt --> num_files = 1 (1 argument)
+    ./dash --parallel a.txt b.txt --> num_files = 2 (each file runs in its own shell)
+    ./dash -c 'line' --> num_files = 0, the line is run like a batch file
+    anything else (or an unknown option) is an error */
+    shell_pid = getpid();
+    char* files[argc];
+    int num_files = parse_options(argc, argv, files);
+    // --resume reads the journal of the run it resumes
+    if (shell->opt.resume && shell->opt.journal == NULL) {
+        num_files = -1;
+    }
+    if (shell->opt.parallel && num_files > 1) {
+        run_scripts(files, num_files, ctx);
+    }
+    if (shell->opt.serve != NULL && num_files == 0) {
+        serve(shell->opt.serve, ctx);
+    }
+    if (shell->opt.worker != NULL && num_files == 0) {
+        int listen_fd = worker_listen(shell->opt.worker);
+        if (listen_fd == -1) {
+            write_error();
+            exit(1);
+        }
+        worker_daemon(listen_fd);
+    }
+    if (num_files >= 0) {
+        init_state(num_files == 1 ? files[0] : "");
+        init_signals(num_files == 0 && !shell->opt.machine && shell->opt.command == NULL);
+    }
+    if (num_files == 0 && shell->opt.command != NULL) {
+        // ./dash -c 'cmd1 & cmd2' runs the string like a batch file
+        if (shell->opt.command[0] == '\0') {
+            exit(0);
+        }
+        FILE* input_file = fmemopen(shell->opt.command, strlen(shell->opt.command), "r");
+        if (!input_file) {
+            write_error();
+            exit(1);
+        }
+        run_stream(input_file, ctx);
+    }
+    else if (num_files == 0 && shell->opt.machine) {
+        run_machine(ctx);
+    }
+    else if (num_files == 0) {
 
         /* Interactive mode. repeatedly prints a prompt dash> and processes
         the input (parses the input, executes the command specified on that 
         line of input, and waits for the command to finish.)
         This is repeated until the user types exit. */
-        while(exit_not_called) {
+        while(ctx->exit_not_called) {
             printf("dash> ");
             char* input = read_input();
-            process(input, &path);
+            shell->current_line++;
+            process(input, ctx);
+            free(input);
         }
     }
-    else if (argc == 2) {
+    else if (num_files == 1) {
+        run_batch(files[0], ctx);
+    }
+    // more than 1 batch file without --parallel or an unknown option
+    else {
+        write_error();
+        exit(1);
+    }
+    // not freed, the exit handlers of the options (see init_state) still use the shell
+    exit(EXIT_SUCCESS);
+}
+#endif
 
-        /* Batch mode. reads input from a batch file and executes commands 
-        from therein. */
-        char* file_name = argv[1]; // argv is pointer array containing each argument passed to the program
-        FILE* input_file = fopen(file_name, "r");
-        if (!input_file) {
-            write_error();
-            exit(1);
+/*
+ *  Function:  init_state
+ *  --------------------
+ *  starts the --spawn-server helper and the --workers and opens what the options keep
+ *  between runs: the --incremental index, the --journal, the duration history, and the
+ *  --report exit handler
+ * 
+ *  batch_file: name of the batch file, "" in interactive mode
+ */
+void init_state(char* batch_file) {
+    // forked first, while the shell is small
+    if (shell->opt.spawn_server) {
+        start_spawn_server();
+    }
+    if (shell->opt.workers != NULL) {
+        start_workers();
+    }
+    if (shell->opt.incremental) {
+        // the index of a batch file is kept next to it
+        if (shell->opt.index_file == NULL) {
+            shell->opt.index_file = malloc(strlen(batch_file) + 12);
+            strcpy(shell->opt.index_file, batch_file);
+            strcat(shell->opt.index_file, ".dash-index");
         }
+        load_index();
+        atexit(save_index);     // exit may be called by the exit built-in command
+    }
+    if (shell->opt.journal != NULL) {
+        open_journal();
+        atexit(sync_journal);
+    }
+    if (shell->opt.report) {
+        shell->report_start = now_ns();
+        atexit(print_report);
+    }
+    // durations are learned and used when the number of running commands is limited
+    if (shell->opt.max_jobs > 0 || shell->opt.adaptive || shell->opt.mem_budget > 0 || shell->opt.history_file != NULL) {
+        open_history();
+    }
+}
 
-        char* input = NULL;
-        size_t bufsize = 0; 
-        // read input line by line from input file
-        while (getline(&input, &bufsize, input_file) != -1) {
-            process(input, &path);
-            input = NULL;
-        }
+/*
+ *  Function:  run_batch
+ *  --------------------
+ *  batch mode. reads input from a batch file and executes commands from therein.
+ *  exits the shell at the end of the file
+ * 
+ *  file_name: name of the batch file
+ *  ctx: the shell
+ */
+void run_batch(char* file_name, struct dash_ctx* ctx) {
+    FILE* input_file = fopen(file_name, "r");
+    if (!input_file) {
+        write_error();
+        exit(1);
+    }
+    run_stream(input_file, ctx);
+}
 
-        // getline returns the value -1 if an error occurs or if end-of-file (eof) is reached
-        // when eof is reached, exit the shell
-        if (feof(input_file)) {
-            fclose(input_file);
-            exit(0);
-        }
-        // error occurred
-        else {
-            fclose(input_file);
-            write_error();
+/*
+ *  Function:  run_stream
+ *  --------------------
+ *  runs every line of an open batch file, then exits the shell. the exit built-in
+ *  command ends the file early
+ * 
+ *  input_file: the batch file (or a --serve script)
+ *  ctx: the shell
+ */
+void run_stream(FILE* input_file, struct dash_ctx* ctx) {
+    char* input = NULL;
+    size_t bufsize = 0; 
+    // independent lines are scheduled to run at the same time
+    if (shell->opt.auto_parallel) {
+        run_auto_parallel(input_file, ctx);
+    }
+    // read input line by line from input file
+    else {
+        int line_number = 0;
+        ssize_t more = getline(&input, &bufsize, input_file);
+        while (ctx->exit_not_called && more != -1) {
+            line_number++;
+            // the next line is read first, so the last line is known (see can_tail_exec)
+            char* next = NULL;
+            size_t next_size = 0;
+            more = getline(&next, &next_size, input_file);
+            ctx->last_line = more == -1 && feof(input_file);
+            run_line(input, line_number, ctx);
+            ctx->last_line = 0;
+            free(input);
+            input = next;
+            bufsize = next_size;
         }
     }
-    // argc > 2
+
+    // getline returns the value -1 if an error occurs or if end-of-file (eof) is reached
+    // when eof is reached or exit was called, exit the shell. like other shells, -c
+    // exits with the status of the last line
+    if (!ctx->exit_not_called || feof(input_file)) {
+        fclose(input_file);
+        exit(shell->opt.command != NULL ? ctx->last_status : 0);
+    }
+    // error occurred
     else {
+        fclose(input_file);
         write_error();
-        exit(1);
     }
-    free(path);     // free malloced path once done using the path variable
-    return EXIT_SUCCESS;
 }
 
 /*
@@ -142,14 +905,17 @@ char* read_input() {
  *  parses the input line and sends it to be executed
  *
  *  input: char pointer to the input line
- *  path: the current path specified (a pointer to the char** path variable used 
- *  elsewhere is passed here to write in this function to the value behind the pointer)
+ *  ctx: the shell. its path is changed by the path command, and exit_not_called
+ *  is set to 0 by exit
+ * 
+ *  returns: 0 if every command succeeded, otherwise the exit status of the last
+ *           command that failed (1 if the line could not be parsed)
  */
-void process(char* input, char*** path) {
+int process(char* input, struct dash_ctx* ctx) {
     // checks for only white space on input line
     // if that is the case, another dash> prompt is printed
     if (check_empty_input(input) == 1) {
-        return;
+        return 0;
     }
     
     // there is input on the line
@@ -160,8 +926,10 @@ void process(char* input, char*** path) {
 
         int parallel_cmd = check_parallel(input);   // check for &
         if (parallel_cmd == -1) {
+            shell->line_error = "syntax";
             write_error();
-            return;
+            ctx->last_status = 1;
+            return 1;
         }
         int redirection = -1;   // initialize redirection to a value that is not possible
         /* parse commands by &.
@@ -176,71 +944,200 @@ void process(char* input, char*** path) {
             // multiple redirection operators or cases such as the following
             // cmd > , > file , cmd > file1 file2 not allowed
             if (redirection > 1 || redirection < 0) {
+                shell->line_error = "redirect";
                 write_error();
-                return;
+                ctx->last_status = 1;
+                return 1;
             }
             arrTok = parse_input(input);
         }
 
-        pid_t pid[parallel_cmd + 1];    // initialize array to hold pids from each fork
-
-        // no parallel commands, so run like a normal input line
-        if (parallel_cmd == 0) {
-            int i = 0;
-            // check if command is built-in
-            // if it is, run the implementation of the command,
-            // and do send it to execute
-            int is_built_in = check_command(arrTok);
-            if (is_built_in == 1) {
-                if (check_path(arrTok) == 1) {
-                    *path = dash_path(arrTok);  // change path
-                }
-                else {
-                    which_built_in(arrTok, parallel_cmd, pid);  // cd or exit
+        /* parse every command into a job before starting any of them, so a command
+        can be checked against the other commands on the line.
+        end condition (parallel_cmd + 1) is the number of commands = number of &'s + 1 */
+        int num_jobs = parallel_cmd + 1;
+        int num_cmds = parallel_cmd > 0 ? count_tokens(arrTok) : 1;
+        struct job jobs[num_jobs];
+        struct job defaults;        // nice and ionice given with no command apply to the rest of the line
+        init_job(&defaults);
+        int i;
+        for (i = 0; i < num_jobs; i++) {
+            init_job(&jobs[i]);
+            jobs[i].generation = i > 0 ? jobs[i - 1].generation : 0;
+            if (parallel_cmd > 0) {
+                // nothing between two &'s
+                if (i >= num_cmds) {
+                    continue;
                 }
-            }
-            // not built-in command so go to execute and wait for the command to finish
-            else {
-                pid[i] = exec_command(arrTok, *path, redirection);
-                wait_for_cmds(pid, parallel_cmd);
-            }
-        }
-        // same logic as no parallel commands but first parse the commands into individual tokens
-        else {
-            char** arr = NULL;
-            int i;
-            /* for loop to execute each command in parallel before waiting for any of them to finish.
-            end condition (parallel_cmd + 1) is the number of commands = number of &'s + 1 */
-            for (i = 0; i < parallel_cmd + 1; i++) {
                 redirection = check_redirect(arrTok[i]);
                 // if redirection error, move onto the next command
                 if (redirection > 1 || redirection < 0) {
+                    jobs[i].error = "redirect";
                     write_error();
+                    jobs[i].status = 1;
                     continue;
                 }
-                arr = parse_input(arrTok[i]);
-                // if no command, move onto the next command (ex. cmd & cmd arg1 &)
-                if (arr[0] == NULL) {
-                    continue;
+                jobs[i].argv = parse_input(arrTok[i]);
+            }
+            else {
+                jobs[i].argv = arrTok;
+            }
+            jobs[i].redirection = redirection;
+            // remove prefixes such as cache from the front of the command
+            if (parse_prefixes(&jobs[i]) == -1) {
+                jobs[i].error = "usage";
+                write_error();
+                jobs[i].status = 1;
+                continue;
+            }
+            // --cache-dir caches the commands with no side effects, the others need cache
+            if (shell->opt.cache_dir != NULL && jobs[i].argv[0] != NULL && is_pure(jobs[i].argv[0])) {
+                jobs[i].cache = 1;
+            }
+            if (jobs[i].argv[0] == NULL) {
+                if (jobs[i].has_nice) {
+                    defaults.has_nice = 1;
+                    defaults.nice = jobs[i].nice;
                 }
-                int is_built_in = check_command(arr);
-                if (is_built_in == 1) {
-                    if (check_path(arr) == 1) {
-                        *path = dash_path(arr);  // change path
-                    }
-                    else {
-                        which_built_in(arr, parallel_cmd, pid);     // cd or exit
-                    }
+                if (jobs[i].ioprio != -1) {
+                    defaults.ioprio = jobs[i].ioprio;
                 }
-                else {
-                    // store pid at index i (1 pid per command)
-                    pid[i] = exec_command(arr, *path, redirection);
+            }
+            if (!jobs[i].has_nice) {
+                jobs[i].has_nice = defaults.has_nice;
+                jobs[i].nice = defaults.nice;
+            }
+            if (jobs[i].ioprio == -1) {
+                jobs[i].ioprio = defaults.ioprio;
+            }
+            expand_vars(ctx, jobs[i].argv);
+            // if no command, move onto the next command (ex. cmd & cmd arg1 &)
+            jobs[i].skip = jobs[i].argv[0] == NULL;
+            // commands after cd or path may run somewhere else or run another executable
+            if (!jobs[i].skip && check_command(jobs[i].argv) == 1) {
+                jobs[i].generation++;
+            }
+        }
+
+        // the commands of the line get a process group of their own (see join_group)
+        shell->line_pgid = 0;
+        // cd and path only change the commands after them, so they run first
+        int dir_fds[num_jobs + 1];
+        int num_dir_fds = scope_dirs(jobs, num_jobs, &ctx->path, dir_fds);
+
+        long line_start = now_ns();
+        if (shell->opt.report) {
+            report_open_pipe();
+        }
+        // identical commands share 1 run, then decide what happens to commands writing the same file
+        if (shell->opt.dedup) {
+            dedup_jobs(jobs, num_jobs);
+        }
+        check_write_conflicts(jobs, num_jobs);
+
+        /* execute each command in parallel before waiting for any of them to finish.
+        check if command is built-in. if it is, run the implementation of the command,
+        and do not send it to execute. the commands between built-in commands (other
+        than cd and path, see scope_dirs) are started together by launch_jobs */
+        i = 0;
+        while (i < num_jobs) {
+            if (jobs[i].skip) {
+                i++;
+                continue;
+            }
+            int is_built_in = check_command(jobs[i].argv) || find_builtin(ctx, jobs[i].argv[0]) != NULL;
+            if (is_built_in == 1) {
+                jobs[i].status = which_built_in(ctx, jobs[i].argv, jobs, num_jobs);    // exit or another built-in
+                i++;
+                // the commands after exit are not started
+                if (!ctx->exit_not_called) {
+                    break;
                 }
-                free(arr);  // free malloced arr for every iteration of loop
+                continue;
+            }
+            int end = i;
+            while (end < num_jobs && (jobs[end].skip ||
+                    (check_command(jobs[end].argv) == 0 && find_builtin(ctx, jobs[end].argv[0]) == NULL))) {
+                end++;
+            }
+            // the last command of a batch file or -c string replaces the shell
+            if (ctx->last_line && can_tail_exec(ctx, jobs, num_jobs, i)) {
+                fflush(stdout);
+                exec_child(&jobs[i], jobs[i].path, 0);
+            }
+            launch_jobs(jobs, num_jobs, i, end);
+            i = end;
+        }
+        // after starting all processes, wait for them to complete
+        wait_for_cmds(jobs, num_jobs);
+        // take the terminal back from the commands
+        if (owns_terminal && shell->line_pgid > 0) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+        // a batch stops when it is interrupted, the interactive shell goes on
+        if (interrupted) {
+            int sig = interrupted;
+            interrupted = 0;
+            if (!interactive_shell) {
+                exit(128 + sig);
+            }
+        }
+        // the shell ends up where the last cd of the line went
+        if (num_dir_fds > 0 && fchdir(dir_fds[num_dir_fds - 1]) == -1) {
+            write_error();
+        }
+        for (i = 0; i < num_dir_fds; i++) {
+            close(dir_fds[i]);
+        }
+        if (shell->opt.progress && shell->spawned > 0) {
+            show_progress(2);
+        }
+        if (shell->opt.report) {
+            report_add(jobs, num_jobs, line_start);
+        }
+        // a duplicate gets the result of the command that ran for it
+        int status = 0;
+        ctx->last_user_us = 0;
+        ctx->last_system_us = 0;
+        ctx->last_max_rss = 0;
+        for (i = 0; i < num_jobs; i++) {
+            ctx->last_user_us += jobs[i].user_us;
+            ctx->last_system_us += jobs[i].system_us;
+            if (jobs[i].max_rss > ctx->last_max_rss) {
+                ctx->last_max_rss = jobs[i].max_rss;
+            }
+            if (jobs[i].dup_of >= 0) {
+                jobs[i].status = jobs[jobs[i].dup_of].status;
+            }
+            // keep the output of successful cacheable commands
+            if (jobs[i].cache_key != 0 && jobs[i].status == 0) {
+                cache_store(&jobs[i]);
+            }
+            if (jobs[i].status != 0) {
+                status = jobs[i].status;
+            }
+        }
+
+        if (shell->opt.machine) {
+            machine_add(jobs, num_jobs);
+        }
+
+        // free malloced tokens of every command, and the paths the path commands replaced
+        for (i = 0; i < num_jobs; i++) {
+            if (jobs[i].path != NULL && jobs[i].argv != NULL && jobs[i].argv[0] != NULL &&
+                    check_path(jobs[i].argv) == 1) {
+                free_path(jobs[i].path);
             }
-            // after starting all processes, wait for them to complete
-            wait_for_cmds(pid, parallel_cmd);
+            if (jobs[i].argv != NULL && jobs[i].argv != arrTok) {
+                free(jobs[i].argv);
+            }
+            free(jobs[i].inputs);
+            free(jobs[i].cache_env);
+            free(jobs[i].cache_target);
         }
+        free(arrTok);
+        ctx->last_status = status;
+        return status;
     }
 }
 
@@ -359,139 +1256,569 @@ char** parse_cmds(char* input) {
 /*
  *  Function:  exec_command
  *  --------------------
- *  creates a process ID (pid) for executing every command using fork(), checks each path
- *  for access to the command, redirects standard output and standard error output of the
- *  command to a file if redirection is present, and executes the command using execv
+ *  starts a command with the backend of the shell: forked by the shell (see
+ *  fork_command), by the --spawn-server helper (see spawn_remote) or by one of the
+ *  --workers (see worker_start). if the backend has gone away, the shell forks it
+ * 
+ *  job: the job of the command. its argv is the tokenized command and its redirection
+ *  is 1 if redirection is present without errors
+ *  path: the current path(s) specified to search through 
+ *  
+ *  returns: pid of command that is executed, -1 with errno set if it was not started
+ */
+pid_t exec_command(struct job* job, char** path) {
+    struct backend* used = backend;
+    pid_t pid = used->start(job, path);
+    if (pid == -1 && backend != used) {
+        pid = backend->start(job, path);
+    }
+    return pid;
+}
+
+/*
+ *  Function:  fork_command
+ *  --------------------
+ *  creates a process ID (pid) for executing every command using fork(), and runs the
+ *  command in the child (see exec_child). the local backend
  * 
- *  arrTok: char** (pointer to pointer) to the tokenized command
+ *  job: the job of the command
  *  path: the current path(s) specified to search through 
- *  redirection: 1 is redirection is present without errors
  *  
  *  returns: pid of command that is executed 
  */
-pid_t exec_command(char** arrTok, char** path, int redirection) {
+pid_t fork_command(struct job* job, char** path) {
     pid_t pid = fork();     // returns a pid
+    /* the child leaves with _exit: exit would flush the batch file stream the child
+    shares with the shell and move the shell back to an earlier line */
 
     // could not create a child process
     /* NOTE: if ulim -u 90 is added to the .bashrc file in your home directory,
-    pid will be less than 0 if more than 90 processes are being executed */
+    pid will be less than 0 if more than 90 processes are being executed.
+    that (EAGAIN) and ENOMEM are retried by launch_jobs, so no error is written */
     if (pid < 0) {
-        write_error();
+        if (errno != EAGAIN && errno != ENOMEM) {
+            write_error();
+        }
     }
     
     // child process successfully created
     else if (pid == 0) {
-        int buf_size = BUF_SIZE;
-        char* path_access = malloc(buf_size * sizeof(char));    // allocate memory
-        char* slash = malloc(5 * sizeof(char));
-        int path_len = count_tokens(path);
-        // empty path
-        if (path_len == 0) {
-            write_error();
-            exit(1);
-        }
-        int j;
-        // search through every path specified
-        for (j = 0; j < path_len; j++) {
-            strcpy(path_access,path[j]);    // add path to path_access
-            strcpy(slash,"/");
-            /* concatenate path_access with a slash and command executable (first token).
-            ex. path_access/executable */
-            strcat(path_access,strcat(slash,arrTok[0]));
-            // access checks if a particular file exists in a directory and is executable
-            // if it is, don't need to look through any more paths 
-            if (access(path_access,X_OK) == 0) {
-                break;
-            }
-            // if all paths have been searched and access still fails, it is an error
-            else if ((j == path_len - 1) && access(path_access,X_OK) == -1) {
-                if (redirection != 1) {
-                    write_error();
-                    exit(1);
-                }
-            }
-        }
-        // write standard output/error to file
-        if (redirection == 1) {
-            int file_index = count_tokens(arrTok) - 1;  // file name index
-            close(1);   // close standard output on screen
-            close(2);   // close standard error on screen
-            // open file descriptor for writing, create file if it does not exist, and truncate/overwrite if it exists
-            int fd = open(arrTok[file_index], O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU);
-            // invalid file descriptor
-            if(fd == -1) {
-                write_error();
-                exit(1);
-            }
-        
-            // set file name index to NULL so it is not included as part of the executable command
-            arrTok[file_index] = NULL;  
-
-            // execv should not return. if it does, an error occurred 
-            if (execv(path_access,arrTok) == -1) {
-                // write the error to the file
-                char error_message[30] = "An error has occurred\n";
-                write(fd, error_message, strlen(error_message));
-                close(fd);
-                redirection = 0;
-                exit(1);
-            }
-            close(fd);
-            redirection = 0;
-        }
-        // no redirection
-        else {
-            // check if execv failed
-            if (execv(path_access,arrTok) == -1) {
-                write_error();
-                exit(1);
-            }
-        }
-        // free all variables used in function
-        free(path_access);
-        free(slash);
-        free(arrTok);
+        exec_child(job, path, 1);
+    }
+    else {
+        add_child(pid);
     }
     return pid;
 }
 
 /*
- *  Function:  wait_for_cmds
+ *  Function:  exec_child
  *  --------------------
- *  waits for process(es) to complete
+ *  runs in the child of a command: places it in the process group, directory, CPUs,
+ *  limits and priority of its job, checks each path for access to the command,
+ *  redirects standard output and standard error output of the command to a file if
+ *  redirection is present, and executes the command using execveat. absolute path
+ *  directories are looked up relative to their descriptor (see path_dir_fd), so their
+ *  path is not walked again. also called in the shell itself to replace it with the
+ *  command (see can_tail_exec and dash_exec). does not return
  * 
- *  pid[]: array of pids for every process
- *  parallel_cmd: the number of parallel commands
+ *  job: the job of the command. its argv is the tokenized command and its redirection
+ *  is 1 if redirection is present without errors
+ *  path: the current path(s) specified to search through 
+ *  group: 1 to put the command in the process group of its line (see join_group), 0
+ *  to keep the group of the shell
  */
-void wait_for_cmds(pid_t pid[], int parallel_cmd) {                
-    int k;
-    // wait for each command to finish
-    for (k = 0; k < parallel_cmd + 1; k++) {
-        int status;
-        do {
-            waitpid(pid[k], &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+void exec_child(struct job* job, char** path, int group) {
+    char** arrTok = job->argv;
+    int redirection = job->redirection;
+    if (group) {
+        join_group(0);
     }
-}
-
-/*
- *  Function:  write_error
- *  --------------------
- *  writes an error when an error of any type is encountered 
- */
-void write_error() {
-    char error_message[30] = "An error has occurred\n";
-    write(STDERR_FILENO, error_message, strlen(error_message));
-}
-
-/*
- *  Function:  check_redirect
- *  --------------------
- *  counts the number of redirection operators in 1 command
- * 
- *  input: char pointer to command
- * 
- *  returns: number of redirection operators in 1 command
+    // the shell ignores SIGTTOU to take the terminal back, the command must not
+    signal(SIGTTOU, SIG_DFL);
+    // run in the directory cd gave the command on its line
+    if (job->dir_fd != -1 && fchdir(job->dir_fd) == -1) {
+        write_error();
+        _exit(1);
+    }
+    // the affinity is inherited by everything the command starts
+    if (job->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &job->cpus) == -1) {
+        write_error();
+        _exit(1);
+    }
+    // hard limits too, so the command cannot raise them again
+    int l;
+    for (l = 0; l < NUM_LIMITS; l++) {
+        struct rlimit limit = {job->limits[l], job->limits[l]};
+        if ((job->limit_set & (1 << l)) && setrlimit(limit_names[l].resource, &limit) == -1) {
+            write_error();
+            _exit(1);
+        }
+    }
+    // lower priority for batch commands, so they do not starve interactive ones
+    if (job->has_nice) {
+        errno = 0;
+        int niceness = getpriority(PRIO_PROCESS, 0);
+        if (errno != 0 || setpriority(PRIO_PROCESS, 0, niceness + job->nice) == -1) {
+            write_error();
+            _exit(1);
+        }
+    }
+    if (job->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, job->ioprio) == -1) {
+        write_error();
+        _exit(1);
+    }
+    // the slot is held until the command exits
+    if (job->sem_name != NULL && sem_acquire(job->sem_name, job->sem_slots) == -1) {
+        write_error();
+        _exit(1);
+    }
+    // --jobs counts the commands of every --parallel batch file together
+    if (jobs_sem != NULL && sem_acquire(jobs_sem, shell->opt.max_jobs) == -1) {
+        write_error();
+        _exit(1);
+    }
+    int buf_size = BUF_SIZE;
+    char* path_access = malloc(buf_size * sizeof(char));    // allocate memory
+    int path_len = count_tokens(path);
+    // empty path
+    if (path_len == 0) {
+        write_error();
+        _exit(1);
+    }
+    int dir_fd = AT_FDCWD;      // directory path_access is relative to
+    int j;
+    // search through every path specified
+    for (j = 0; j < path_len; j++) {
+        dir_fd = path_dir_fd(path[j]);
+        // the executable (first token) in the directory's descriptor
+        if (dir_fd != -1) {
+            snprintf(path_access, buf_size, "%s", arrTok[0]);
+        }
+        /* a relative directory is resolved where the command runs, so it is
+        joined with a slash and the executable. ex. path_access/executable */
+        else {
+            dir_fd = AT_FDCWD;
+            snprintf(path_access, buf_size, "%s/%s", path[j], arrTok[0]);
+        }
+        // faccessat checks if a particular file exists in a directory and is executable
+        // if it is, don't need to look through any more paths 
+        if (faccessat(dir_fd, path_access, X_OK, 0) == 0) {
+            break;
+        }
+        // if all paths have been searched and access still fails, it is an error.
+        // like other shells, a command that is not found exits with 127
+        else if (j == path_len - 1) {
+            if (redirection != 1) {
+                write_error();
+                _exit(127);
+            }
+        }
+    }
+    char* dir = j < path_len ? path[j] : NULL;    // directory the command was found in
+    // tell --report when the command is about to start
+    report_exec();
+    // write standard output/error to file
+    if (redirection == 1) {
+        int file_index = count_tokens(arrTok) - 1;  // file name index
+        close(1);   // close standard output on screen
+        close(2);   // close standard error on screen
+        // open file descriptor for writing, create file if it does not exist, and truncate/overwrite if it exists
+        int fd = open(arrTok[file_index], O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU);
+        // invalid file descriptor
+        if(fd == -1) {
+            write_error();
+            _exit(1);
+        }
+    
+        // set file name index to NULL so it is not included as part of the executable command
+        arrTok[file_index] = NULL;  
+
+        // execveat should not return. if it does, an error occurred 
+        if (exec_in_dir(dir_fd, dir, path_access, arrTok) == -1) {
+            // write the error to the file
+            char error_message[30] = "An error has occurred\n";
+            write(fd, error_message, strlen(error_message));
+            close(fd);
+            redirection = 0;
+            _exit(errno == ENOENT ? 127 : 126);
+        }
+        close(fd);
+        redirection = 0;
+    }
+    // no redirection
+    else {
+        // check if execveat failed. a command that cannot be executed exits with 126
+        if (exec_in_dir(dir_fd, dir, path_access, arrTok) == -1) {
+            write_error();
+            _exit(errno == ENOENT ? 127 : 126);
+        }
+    }
+    // free all variables used in function
+    free(path_access);
+    free(arrTok);
+    _exit(1);
+}
+
+/*
+ *  Function:  exec_in_dir
+ *  --------------------
+ *  replaces the process with a command found in a path directory. the directory
+ *  descriptor stays close-on-exec, so commands do not inherit it. the kernel starts
+ *  a script's interpreter with /dev/fd/N/name, which does not exist once the
+ *  descriptor is closed, so a script is started again by its full name
+ * 
+ *  dir_fd: descriptor of the directory, or AT_FDCWD if name is a path itself
+ *  dir: the directory as written in the path command (NULL if none)
+ *  name: the command, relative to dir_fd
+ *  argv: the tokens of the command
+ * 
+ *  returns: -1 with errno set (it does not return on success)
+ */
+int exec_in_dir(int dir_fd, char* dir, char* name, char** argv) {
+    execveat(dir_fd, name, argv, environ, 0);
+    int saved_errno = errno;
+    // the command itself exists, so it is a script
+    if (saved_errno == ENOENT && dir_fd != AT_FDCWD && dir != NULL && faccessat(dir_fd, name, X_OK, 0) == 0) {
+        char* full = malloc(strlen(dir) + strlen(name) + 2);
+        sprintf(full, "%s/%s", dir, name);
+        execve(full, argv, environ);
+        free(full);
+    }
+    // report why the descriptor could not be used if the full name cannot be either
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ *  Function:  wait_for_cmds
+ *  --------------------
+ *  waits for process(es) to complete
+ * 
+ *  jobs[]: array of jobs, jobs that are not running are skipped
+ *  num_jobs: the number of jobs
+ */
+void wait_for_cmds(struct job jobs[], int num_jobs) {                
+    // wait for each command to finish, in the order they finish so the
+    // time each one ends is known
+    int k = 0;
+    while (k < num_jobs) {
+        if (jobs[k].state == JOB_RUNNING) {
+            reap_one(jobs, num_jobs);
+            // a command on an earlier line that was not waited for cannot be running
+            if (shell->running_jobs <= 0) {
+                break;
+            }
+        }
+        else {
+            k++;
+        }
+    }
+}
+
+/*
+ *  Function:  reap_one
+ *  --------------------
+ *  waits for any running command to complete (stopped commands are waited for
+ *  until they finish)
+ * 
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ */
+void reap_one(struct job jobs[], int num_jobs) {
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    do {
+        pid = wait_cmd(&status, &usage, WUNTRACED);
+    } while (pid > 0 && !WIFEXITED(status) && !WIFSIGNALED(status));
+    if (pid == -1) {
+        // nothing is running, do not wait again
+        shell->running_jobs = 0;
+        int k;
+        for (k = 0; k < num_jobs; k++) {
+            if (jobs[k].state == JOB_RUNNING) {
+                jobs[k].status = 1;
+                jobs[k].state = JOB_DONE;
+            }
+        }
+        return;
+    }
+    int k;
+    for (k = 0; k < num_jobs; k++) {
+        if (jobs[k].state == JOB_RUNNING && jobs[k].pid == pid) {
+            finish_job(&jobs[k], status, &usage);
+            return;
+        }
+    }
+}
+
+/*
+ *  Function:  finish_job
+ *  --------------------
+ *  records the result of a command that has been waited for
+ * 
+ *  job: the job of the command
+ *  status: status returned by wait4
+ *  usage: resources used by the command
+ */
+void finish_job(struct job* job, int status, struct rusage* usage) {
+    job->end = now_ns();
+    job->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    job->state = JOB_DONE;
+    // Ctrl-C on the terminal reaches the commands that have it, not the shell
+    if (owns_terminal && WIFSIGNALED(status) && (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGQUIT)) {
+        interrupted = WTERMSIG(status);
+    }
+    job->user_us = usage->ru_utime.tv_sec * 1000000L + usage->ru_utime.tv_usec;
+    job->system_us = usage->ru_stime.tv_sec * 1000000L + usage->ru_stime.tv_usec;
+    job->max_rss = usage->ru_maxrss;
+    shell->running_jobs--;
+    history_record(job, job->end - job->start);
+    if (shell->opt.progress) {
+        show_progress(0);
+    }
+}
+
+/*
+ *  Function:  launch_jobs
+ *  --------------------
+ *  starts the commands of a line between 2 built-in commands. with --jobs, at most
+ *  that many commands run at once, and the ones the duration history predicts to take
+ *  longest start first (longest processing time first), then the unknown ones in the
+ *  order they were written. a command serialized after another (see
+ *  check_write_conflicts) starts once that one has finished. with --spawn-rate, starts
+ *  are spread out to that many per second. with --mem-budget, a command whose predicted
+ *  peak memory does not fit next to the running commands is held back while later
+ *  commands that fit start (see fits_budget). a fork that fails for lack of processes or
+ *  memory is retried once a running command has finished, or after a backoff delay
+ * 
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ *  first: index of the first job to start
+ *  last: index after the last job to start
+ */
+void launch_jobs(struct job jobs[], int num_jobs, int first, int last) {
+    int order[last - first];
+    int num_order = 0;
+    int k;
+    long now = now_ns();
+    int limit = job_limit();
+    for (k = first; k < last; k++) {
+        if (jobs[k].skip) {
+            continue;
+        }
+        jobs[k].queued = now;
+        jobs[k].predicted = history_predict(&jobs[k]);
+        jobs[k].predicted_rss = history_predict_rss(&jobs[k]);
+        // insertion sort, longest predicted first, written order otherwise
+        int pos = num_order;
+        while (limit > 0 && pos > 0 && jobs[k].predicted > jobs[order[pos - 1]].predicted) {
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = k;
+        num_order++;
+    }
+
+    int launched = 0;
+    int failures = 0;           // fork failures of the next command in a row
+    long backoff = FORK_BACKOFF_NS;
+    while (launched < num_order) {
+        // a signal cuts the waits for --spawn-rate and fork retries short, the rest of the line does not start
+        if (interrupted) {
+            for (k = 0; k < num_order; k++) {
+                if (jobs[order[k]].state == JOB_PENDING) {
+                    jobs[order[k]].status = 128 + interrupted;
+                    jobs[order[k]].state = JOB_DONE;
+                }
+            }
+            break;
+        }
+        int next = -1;
+        limit = job_limit();
+        if (limit == 0 || shell->running_jobs < limit) {
+            for (k = 0; k < num_order && next == -1; k++) {
+                struct job* job = &jobs[order[k]];
+                if (job->state == JOB_PENDING && (job->after < 0 || jobs[job->after].state == JOB_DONE) &&
+                        fits_budget(jobs, num_jobs, job)) {
+                    next = order[k];
+                }
+            }
+        }
+        // wait for a running command to make room or to finish what the next one needs
+        if (next == -1) {
+            shell->pressure.held_back = limit > 0 && shell->running_jobs >= limit;
+            reap_one(jobs, num_jobs);
+            continue;
+        }
+        if (shell->opt.cpu_policy != CPU_NONE) {
+            assign_cpu(jobs, num_jobs, next);
+        }
+        if (shell->opt.spawn_rate > 0) {
+            wait_for_token();
+            if (interrupted) {
+                continue;
+            }
+        }
+        if (start_job(&jobs[next]) == -1) {
+            shell->fork_retries++;
+            if (failures < FORK_RETRIES) {
+                failures++;
+                // a finished command frees what the fork needs
+                if (shell->running_jobs > 0) {
+                    reap_one(jobs, num_jobs);
+                    continue;
+                }
+                struct timespec delay = {backoff / 1000000000L, backoff % 1000000000L};
+                nanosleep(&delay, NULL);
+                backoff = backoff * 2 < FORK_BACKOFF_MAX_NS ? backoff * 2 : FORK_BACKOFF_MAX_NS;
+                continue;
+            }
+            // give up on this command
+            jobs[next].error = "fork";
+            write_error();
+            jobs[next].status = 1;
+            jobs[next].state = JOB_DONE;
+        }
+        failures = 0;
+        backoff = FORK_BACKOFF_NS;
+        launched++;
+    }
+}
+
+/*
+ *  Function:  start_job
+ *  --------------------
+ *  starts 1 command, or restores its output from the result cache
+ * 
+ *  job: the job to start
+ * 
+ *  returns: 0 if the job was started or has finished, -1 if fork failed for lack of
+ *           processes or memory and the job is still pending
+ */
+int start_job(struct job* job) {
+    // the cached output is restored instead of running the command. the key and
+    // the files it covers are relative to the directory of the command
+    if (job->cache) {
+        if (job->dir_fd != -1 && fchdir(job->dir_fd) == -1) {
+            write_error();
+        }
+        if (cache_lookup(job, job->path) == 1) {
+            job->state = JOB_DONE;
+            return 0;
+        }
+    }
+    job->start = now_ns();
+    // store pid in the job (1 pid per command)
+    job->pid = exec_command(job, job->path);
+    job->forked = now_ns();
+    // set the group in the shell too, so it is set whichever of the 2 runs first.
+    // the --spawn-server helper and the workers do that for the commands they start
+    if (job->pid > 0 && backend->shell_groups) {
+        join_group(job->pid);
+    }
+    if (job->pid < 0) {
+        if (errno == EAGAIN || errno == ENOMEM) {
+            return -1;
+        }
+        job->error = "fork";
+        job->status = 1;
+        job->state = JOB_DONE;
+        return 0;
+    }
+    job->state = JOB_RUNNING;
+    shell->running_jobs++;
+    shell->spawned++;
+    if (shell->opt.progress) {
+        show_progress(0);
+    }
+    return 0;
+}
+
+/*
+ *  Function:  wait_for_token
+ *  --------------------
+ *  token bucket for --spawn-rate: the bucket fills at the spawn rate and holds at most
+ *  1 second of starts, so a burst after an idle moment is limited too. waits until
+ *  there is a token and takes it
+ */
+void wait_for_token() {
+    long now = now_ns();
+    double capacity = shell->opt.spawn_rate > 1 ? shell->opt.spawn_rate : 1;
+    if (shell->spawn_refill == 0) {
+        shell->spawn_tokens = capacity;
+    }
+    else {
+        shell->spawn_tokens += (now - shell->spawn_refill) / 1e9 * shell->opt.spawn_rate;
+        if (shell->spawn_tokens > capacity) {
+            shell->spawn_tokens = capacity;
+        }
+    }
+    shell->spawn_refill = now;
+    if (shell->spawn_tokens < 1) {
+        long wait = (1 - shell->spawn_tokens) / shell->opt.spawn_rate * 1e9;
+        struct timespec delay = {wait / 1000000000L, wait % 1000000000L};
+        nanosleep(&delay, NULL);
+        shell->spawn_tokens = 1;
+        shell->spawn_refill = now_ns();
+    }
+    shell->spawn_tokens--;
+}
+
+/*
+ *  Function:  show_progress
+ *  --------------------
+ *  redraws the --progress line on standard error: the commands running now, the
+ *  commands started so far and the forks that were retried. it is drawn at most
+ *  10 times a second, and only when standard error is a terminal
+ * 
+ *  force: 1 to draw even if it was drawn recently, 2 to erase the line
+ */
+void show_progress(int force) {
+    if (!isatty(STDERR_FILENO)) {
+        return;
+    }
+    long now = now_ns();
+    if (force == 0 && now - shell->progress_shown < 100000000L) {
+        return;
+    }
+    shell->progress_shown = now;
+    char line[128];
+    int len;
+    if (force == 2) {
+        len = snprintf(line, sizeof(line), "\r\033[K");
+    }
+    else {
+        len = snprintf(line, sizeof(line), "\r\033[Kdash: %d running, %d started, %d fork retries",
+                       shell->running_jobs, shell->spawned, shell->fork_retries);
+    }
+    write(STDERR_FILENO, line, len);
+}
+
+/*
+ *  Function:  write_error
+ *  --------------------
+ *  writes an error when an error of any type is encountered. with --machine, a more
+ *  precise code may be set in line_error before it is called
+ */
+void write_error() {
+    // --machine reports a code instead of the message (see run_machine)
+    if (shell->line_error == NULL) {
+        shell->line_error = "error";
+    }
+    char error_message[30] = "An error has occurred\n";
+    write(STDERR_FILENO, error_message, strlen(error_message));
+}
+
+/*
+ *  Function:  check_redirect
+ *  --------------------
+ *  counts the number of redirection operators in 1 command
+ * 
+ *  input: char pointer to command
+ * 
+ *  returns: number of redirection operators in 1 command
  */
 int check_redirect(char* input) {
     int redirect_count = 0;
@@ -618,17 +1945,16 @@ int check_path(char** arrTok) {
  * 
  *  arrTok: char** that has been tokenized
  */
-void dash_exit(char** arrTok) {
+void dash_exit(struct dash_ctx* ctx, char** arrTok) {
     // count arguments in arrTok (excluding exit)
     int args = count_tokens(arrTok) - 1;
     // error to pass any arguments to exit
     if (args != 0) {
         write_error();
     }
-    // call the exit system call with 0 as parameter
+    // the shell stops after this line (see main and run_stream)
     else {
-        exit_not_called = 0;
-        exit(0);
+        ctx->exit_not_called = 0;
     }
 }
 
@@ -637,13 +1963,14 @@ void dash_exit(char** arrTok) {
  *  --------------------
  *  built-in implementation of exit command if there are parallel commands.
  *  if exit is called in a parallel command, the program must wait for all commands
- *  to finish before exiting
+ *  to finish before exiting. with --drain-timeout, the commands still running at
+ *  the deadline are killed together
  * 
  *  arrTok: char** that has been tokenized
- *  parallel_cmd: the number of parallel commands
- *  pid[]: array of pids for each process
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
  */
-void dash_exit2(char** arrTok, int parallel_cmd, pid_t pid[]) {
+void dash_exit2(struct dash_ctx* ctx, char** arrTok, struct job jobs[], int num_jobs) {
     // count arguments in arrTok (excluding exit)
     int args = count_tokens(arrTok) - 1;
     // error to pass any arguments to exit
@@ -651,35 +1978,96 @@ void dash_exit2(char** arrTok, int parallel_cmd, pid_t pid[]) {
         write_error();
     }
     else {
-        exit_not_called = 0;
+        ctx->exit_not_called = 0;
         // wait before exiting
-        if (parallel_cmd > 0) {
-            wait_for_cmds(pid, parallel_cmd);
+        if (num_jobs > 1 && shell->opt.drain_timeout >= 0) {
+            drain_jobs(jobs, num_jobs, now_ns() + shell->opt.drain_timeout);
+        }
+        else if (num_jobs > 1) {
+            wait_for_cmds(jobs, num_jobs);
         }
-        exit(0);    // call the exit system call with 0 as parameter
     }
 }
 
 /*
  *  Function:  dash_cd
  *  --------------------
- *  built-in implementation of cd command
+ *  built-in implementation of cd command. the directory is opened rather than
+ *  changed to, so it only applies to the commands after cd (see scope_dirs)
  * 
  *  arrTok: char** that has been tokenized
+ *  dir_fd: directory a relative argument starts from
+ * 
+ *  returns: file descriptor of the new directory, -1 if it cannot be opened
  */
-void dash_cd(char** arrTok) {
+int dash_cd(char** arrTok, int dir_fd) {
     // count arguments in arrTok (excluding cd)
     int args = count_tokens(arrTok) - 1;
     // anything other than 1 argument is error
     if (args == 0 || args > 1) {
         write_error();
+        return -1;
     }
-    else {
-        // change directory to argument 
-        if (chdir(arrTok[1]) != 0) {
-            write_error();
+    // open the directory in the argument
+    int new_fd = openat(dir_fd, arrTok[1], O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (new_fd == -1) {
+        write_error();
+    }
+    return new_fd;
+}
+
+/*
+ *  Function:  scope_dirs
+ *  --------------------
+ *  runs the cd and path commands of a line before any command starts. every command
+ *  gets the directory (an O_PATH file descriptor the child changes to) and the path
+ *  that the cd and path commands before it on the line leave, so a cd only affects
+ *  the commands after it and does not depend on when the commands before it start
+ * 
+ *  jobs[]: array of parsed jobs on the line
+ *  num_jobs: the number of jobs
+ *  path: pointer to the current path variable, set to the path after the line
+ *  dir_fds: receives the directories opened, at most num_jobs + 1. the shell's
+ *  directory is first and the directory after the line is last
+ * 
+ *  returns: number of directories in dir_fds
+ */
+int scope_dirs(struct job jobs[], int num_jobs, char*** path, int dir_fds[]) {
+    int num_dir_fds = 0;
+    int dir_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+        dir_fds[num_dir_fds] = dir_fd;
+        num_dir_fds++;
+    }
+    int i;
+    for (i = 0; i < num_jobs; i++) {
+        if (jobs[i].skip) {
+            continue;
+        }
+        if (strcmp(jobs[i].argv[0], built_in_commands[1]) == 0) {
+            int new_fd = dash_cd(jobs[i].argv, dir_fd != -1 ? dir_fd : AT_FDCWD);
+            if (new_fd == -1) {
+                jobs[i].error = "cd";
+                jobs[i].status = 1;
+            }
+            else {
+                dir_fd = new_fd;
+                dir_fds[num_dir_fds] = dir_fd;
+                num_dir_fds++;
+            }
+            jobs[i].skip = 1;
+            continue;
+        }
+        if (check_path(jobs[i].argv) == 1) {
+            jobs[i].path = *path;               // the commands before it still use it, freed after the line
+            *path = dash_path(jobs[i].argv);    // change path
+            jobs[i].skip = 1;
+            continue;
         }
+        jobs[i].dir_fd = dir_fd;
+        jobs[i].path = *path;
     }
+    return num_dir_fds;
 }
 
 /*
@@ -692,14 +2080,15 @@ void dash_cd(char** arrTok) {
  *  returns: char** to path variable 
  */
 char** dash_path(char** arrTok) {
-    char** path_changed = malloc(BUF_SIZE * sizeof(char*));     // allocate memory
+    int args = count_tokens(arrTok) - 1;
+    char** path_changed = malloc((args + 1) * sizeof(char*));   // allocate memory
     // path arguments are given
     if (arrTok[1] != NULL) {
-        int args = count_tokens(arrTok) - 1;
         int i;
         for (i = 0; i < args; i++) {
-            // set path to the arrTok arguments supplied in the path command
-            path_changed[i] = arrTok[i+1];
+            // set path to the arrTok arguments supplied in the path command.
+            // the tokens point into the input line, which is not kept
+            path_changed[i] = strdup(arrTok[i+1]);
         }
         path_changed[args] = NULL;      // set last index to NULL
     }
@@ -707,9 +2096,99 @@ char** dash_path(char** arrTok) {
     else {
         path_changed[0] = NULL;
     }
+    // the directories are opened again, a name may now lead somewhere else
+    open_path_dirs(shell, path_changed);
     return path_changed;
 }
 
+/*
+ *  Function:  free_path
+ *  --------------------
+ *  frees a path variable made by dash_path or dash_ctx_new
+ * 
+ *  path: the path, NULL terminated
+ */
+void free_path(char** path) {
+    int i;
+    for (i = 0; path[i] != NULL; i++) {
+        free(path[i]);
+    }
+    free(path);
+}
+
+/*
+ *  Function:  path_dir_fd
+ *  --------------------
+ *  gets the O_PATH descriptor of an absolute path directory. the directories of the
+ *  current path were opened by open_path_dirs, others (of the path a path command
+ *  on the same line replaced, or sent to the --spawn-server helper or a worker) are
+ *  opened now, and closed by execve. relative directories are not opened, since they
+ *  depend on the directory a command runs in. called in the process about to exec
+ * 
+ *  dir: the directory as written in the path command
+ * 
+ *  returns: the descriptor, or -1 if the directory is relative or cannot be opened
+ */
+int path_dir_fd(char* dir) {
+    if (dir[0] != '/') {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < shell->num_path_dirs; i++) {
+        if (strcmp(shell->path_dirs[i].name, dir) == 0) {
+            return shell->path_dirs[i].fd;
+        }
+    }
+    return open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ *  Function:  open_path_dirs
+ *  --------------------
+ *  opens the absolute directories of a new path once, for every command using it
+ *  (see path_dir_fd), and closes the ones of the path it replaces
+ * 
+ *  ctx: the shell
+ *  path: the new path, NULL terminated
+ */
+void open_path_dirs(struct dash_ctx* ctx, char** path) {
+    close_path_dirs(ctx);
+    int i;
+    for (i = 0; path[i] != NULL; i++) {
+        if (path[i][0] != '/') {
+            continue;
+        }
+        ctx->path_dirs = realloc(ctx->path_dirs, (ctx->num_path_dirs + 1) * sizeof(struct path_dir));
+        if (!ctx->path_dirs) {
+            write_error();
+            exit(1);
+        }
+        ctx->path_dirs[ctx->num_path_dirs].name = strdup(path[i]);
+        ctx->path_dirs[ctx->num_path_dirs].fd = open(path[i], O_PATH | O_DIRECTORY | O_CLOEXEC);
+        ctx->num_path_dirs++;
+    }
+}
+
+/*
+ *  Function:  close_path_dirs
+ *  --------------------
+ *  closes the directories open_path_dirs opened
+ * 
+ *  ctx: the shell
+ */
+void close_path_dirs(struct dash_ctx* ctx) {
+    int i;
+    for (i = 0; i < ctx->num_path_dirs; i++) {
+        free(ctx->path_dirs[i].name);
+        if (ctx->path_dirs[i].fd != -1) {
+            close(ctx->path_dirs[i].fd);
+        }
+    }
+    free(ctx->path_dirs);
+    ctx->path_dirs = NULL;
+    ctx->num_path_dirs = 0;
+}
+
 /*
  *  Function:  count_tokens
  *  --------------------
@@ -730,22 +2209,5240 @@ int count_tokens(char** arr) {
  *  --------------------
  *  sends the command to the function that implements the built-in command
  * 
+ *  ctx: the shell
  *  arrTok: char** that has been tokenized
- *  parallel_cmd: the number of parallel commands
- *  pid[]: array of pids for each process
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ * 
+ *  returns: status of a built-in command registered with dash_register_builtin or of
+ *           exec, 0 for the others
  */
-void which_built_in(char** arrTok, int parallel_cmd, pid_t pid[]) {
+int which_built_in(struct dash_ctx* ctx, char** arrTok, struct job jobs[], int num_jobs) {
+    struct dash_builtin* builtin = find_builtin(ctx, arrTok[0]);
+    if (builtin != NULL) {
+        return builtin->fn(ctx, arrTok, builtin->data);
+    }
     // check_path function sends command to path built-in function
     if (strcmp(arrTok[0], built_in_commands[0]) == 0) {
         // 2 exit implementations to choose from
-        if (parallel_cmd > 0) {
-            dash_exit2(arrTok, parallel_cmd, pid);
+        if (num_jobs > 1) {
+            dash_exit2(ctx, arrTok, jobs, num_jobs);
         }
         else {
-            dash_exit(arrTok);
+            dash_exit(ctx, arrTok);
         }
     }
-    else if (strcmp(arrTok[0], built_in_commands[1]) == 0) {
-        dash_cd(arrTok);
+    else if (strcmp(arrTok[0], built_in_commands[3]) == 0) {
+        dash_pure(arrTok);
+    }
+    else if (strcmp(arrTok[0], built_in_commands[4]) == 0) {
+        dash_cache(arrTok);
+    }
+    else if (strcmp(arrTok[0], built_in_commands[5]) == 0) {
+        dash_affinity(arrTok);
+    }
+    else if (strcmp(arrTok[0], built_in_commands[6]) == 0) {
+        dash_ulimit(arrTok);
+    }
+    else if (strcmp(arrTok[0], built_in_commands[7]) == 0) {
+        return dash_exec(ctx, arrTok, jobs, num_jobs);
     }
-}
\ No newline at end of file
+    return 0;
+}
+
+/*
+ *  Function:  find_builtin
+ *  --------------------
+ *  looks up a built-in command registered with dash_register_builtin
+ * 
+ *  ctx: the shell
+ *  name: name of the command
+ * 
+ *  returns: the built-in command, or NULL if none has the name
+ */
+struct dash_builtin* find_builtin(struct dash_ctx* ctx, char* name) {
+    int i;
+    for (i = 0; i < ctx->num_builtins; i++) {
+        if (strcmp(ctx->builtins[i].name, name) == 0) {
+            return &ctx->builtins[i];
+        }
+    }
+    return NULL;
+}
+/*
+ *  Function:  parse_options
+ *  --------------------
+ *  sets the options given as command line flags and collects the remaining
+ *  arguments as batch file names
+ * 
+ *  argc: number of command line arguments
+ *  argv: command line arguments
+ *  files: array (at least argc long) that receives the batch file names
+ * 
+ *  returns: number of batch files or -1 if an unknown option is given
+ */
+int parse_options(int argc, char* argv[], char* files[]) {
+    int num_files = 0;
+    char* value;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--auto-parallel") == 0) {
+            shell->opt.auto_parallel = 1;
+        }
+        // --explain only makes sense for the --auto-parallel schedule
+        else if (strcmp(argv[i], "--explain") == 0) {
+            shell->opt.auto_parallel = 1;
+            shell->opt.explain = 1;
+        }
+        else if (strcmp(argv[i], "--incremental") == 0) {
+            shell->opt.incremental = 1;
+        }
+        else if (strncmp(argv[i], "--incremental=", 14) == 0 && argv[i][14] != '\0') {
+            shell->opt.incremental = 1;
+            shell->opt.index_file = argv[i] + 14;
+        }
+        else if ((value = option_value(argc, argv, &i, "--journal")) != NULL) {
+            if (value[0] == '\0') {
+                return -1;
+            }
+            shell->opt.journal = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--jobs")) != NULL) {
+            shell->opt.max_jobs = atoi(value);
+            shell->opt.adaptive = strcmp(value, "auto") == 0;
+            if (shell->opt.max_jobs <= 0 && !shell->opt.adaptive) {
+                return -1;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--mem-budget")) != NULL) {
+            shell->opt.mem_budget = parse_size(value) / 1024;
+            if (shell->opt.mem_budget <= 0) {
+                return -1;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--history")) != NULL) {
+            if (value[0] == '\0') {
+                return -1;
+            }
+            shell->opt.history_file = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--spawn-rate")) != NULL) {
+            shell->opt.spawn_rate = atof(value);
+            if (shell->opt.spawn_rate <= 0) {
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--parallel") == 0) {
+            shell->opt.parallel = 1;
+        }
+        else if ((value = option_value(argc, argv, &i, "--output-dir")) != NULL) {
+            if (value[0] == '\0') {
+                return -1;
+            }
+            shell->opt.output_dir = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--drain-timeout")) != NULL) {
+            char* end;
+            double seconds = strtod(value, &end);
+            if (end == value || *end != '\0' || seconds < 0) {
+                return -1;
+            }
+            shell->opt.drain_timeout = seconds * 1e9;
+        }
+        else if (strcmp(argv[i], "--progress") == 0) {
+            shell->opt.progress = 1;
+        }
+        else if (strcmp(argv[i], "--spawn-server") == 0) {
+            shell->opt.spawn_server = 1;
+        }
+        else if (strcmp(argv[i], "--machine") == 0) {
+            shell->opt.machine = 1;
+        }
+        else if ((value = option_value(argc, argv, &i, "--workers")) != NULL) {
+            // a number of local workers, or worker sockets
+            char* end;
+            long num = strtol(value, &end, 10);
+            if (value[0] == '\0' || (*end == '\0' && num <= 0)) {
+                return -1;
+            }
+            shell->opt.workers = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--worker")) != NULL) {
+            if (value[0] == '\0') {
+                return -1;
+            }
+            shell->opt.worker = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--serve")) != NULL) {
+            if (value[0] == '\0') {
+                return -1;
+            }
+            shell->opt.serve = value;
+        }
+        else if (strcmp(argv[i], "--report") == 0) {
+            shell->opt.report = 1;
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            shell->opt.resume = 1;
+        }
+        else if (strcmp(argv[i], "--dedup") == 0) {
+            shell->opt.dedup = 1;
+        }
+        else if ((value = option_value(argc, argv, &i, "--cache-dir")) != NULL) {
+            if (value[0] == '\0') {
+                return -1;
+            }
+            shell->opt.cache_dir = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--cache-size")) != NULL) {
+            shell->opt.cache_size = parse_size(value);
+            if (shell->opt.cache_size <= 0) {
+                return -1;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--cpu-policy")) != NULL) {
+            cpu_set_t set;
+            if (strcmp(value, "spread") == 0) {
+                shell->opt.cpu_policy = CPU_SPREAD;
+            }
+            else if (strcmp(value, "compact") == 0) {
+                shell->opt.cpu_policy = CPU_COMPACT;
+            }
+            else if (parse_cpu_list(value, &set) == 0) {
+                shell->opt.cpu_policy = CPU_LIST;
+                shell->opt.cpu_list = value;
+            }
+            else {
+                return -1;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--redirect-policy")) != NULL) {
+            if (strcmp(value, "serialize") == 0) {
+                shell->opt.redirect_policy = POLICY_SERIALIZE;
+            }
+            else if (strcmp(value, "error") == 0) {
+                shell->opt.redirect_policy = POLICY_ERROR;
+            }
+            else if (strcmp(value, "last") == 0) {
+                shell->opt.redirect_policy = POLICY_LAST;
+            }
+            else {
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            if (i + 1 >= argc) {
+                return -1;
+            }
+            i++;
+            shell->opt.command = argv[i];
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            return -1;
+        }
+        else {
+            files[num_files] = argv[i];
+            num_files++;
+        }
+    }
+    return num_files;
+}
+
+/*
+ *  Function:  option_value
+ *  --------------------
+ *  gets the value of an option given as --name=value or --name value
+ * 
+ *  argc: number of command line arguments
+ *  argv: command line arguments
+ *  i: pointer to the index of the argument to check, moved past the value
+ *  name: option name including the leading --
+ * 
+ *  returns: the value, or NULL if the argument is a different option
+ */
+char* option_value(int argc, char* argv[], int* i, char* name) {
+    int len = strlen(name);
+    if (strncmp(argv[*i], name, len) != 0) {
+        return NULL;
+    }
+    if (argv[*i][len] == '=') {
+        return argv[*i] + len + 1;
+    }
+    // a missing value is an empty value, which is never valid
+    if (argv[*i][len] == '\0') {
+        if (*i + 1 < argc) {
+            (*i)++;
+            return argv[*i];
+        }
+        return "";
+    }
+    return NULL;
+}
+
+/*
+ *  Function:  run_auto_parallel
+ *  --------------------
+ *  runs a batch file with consecutive lines that do not conflict executed at the
+ *  same time. lines are analyzed (see analyze_line) one group at a time using the
+ *  current directory, so a cd runs before the lines after it are analyzed.
+ *  a group ends at the first line that conflicts with a line already in it or at
+ *  a barrier (cd, path, exit, ps, or a command not in known_commands and not marked
+ *  with pure, which may write any file), which runs alone. output is replayed in line
+ *  order, so it is the same as running the file one line at a time
+ * 
+ *  input_file: batch file to read lines from
+ *  ctx: the shell
+ */
+void run_auto_parallel(FILE* input_file, struct dash_ctx* ctx) {
+    char** lines = NULL;
+    int num_lines = 0;
+    int lines_size = 0;
+    char* input = NULL;
+    size_t bufsize = 0;
+    // the whole file is read first so later lines can be scheduled early
+    while (getline(&input, &bufsize, input_file) != -1) {
+        if (num_lines >= lines_size) {
+            lines_size += BUF_SIZE;
+            lines = realloc(lines, lines_size * sizeof(char*));
+            if (!lines) {
+                write_error();
+                exit(1);
+            }
+        }
+        lines[num_lines] = input;
+        num_lines++;
+        input = NULL;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        write_error();
+        return;
+    }
+
+    struct line_deps* deps = malloc((num_lines + 1) * sizeof(struct line_deps));
+    int stage = 0;
+    int i = 0;
+    while (i < num_lines) {
+        if (check_empty_input(lines[i]) == 1) {
+            i++;
+            continue;
+        }
+        analyze_line(lines[i], cwd, &deps[i]);
+        stage++;
+
+        // barriers run alone and may change the directory for the lines after them
+        if (deps[i].barrier != NULL || deps[i].unknown != NULL) {
+            if (shell->opt.explain) {
+                printf("stage %d: line %d (barrier: %s)\n", stage, i + 1,
+                       deps[i].barrier != NULL ? deps[i].barrier : deps[i].unknown);
+                // follow cd so the lines after it are analyzed in the right directory
+                char* copy = strdup(lines[i]);
+                char** arr = parse_input(copy);
+                if (strcmp(arr[0], built_in_commands[1]) == 0 && arr[1] != NULL && arr[2] == NULL) {
+                    char* dir = normalize_path(cwd, arr[1]);
+                    strcpy(cwd, dir);
+                    free(dir);
+                }
+                free(arr);
+                free(copy);
+            }
+            else {
+                run_line(lines[i], i + 1, ctx);
+                if (!ctx->exit_not_called) {
+                    break;
+                }
+                if (getcwd(cwd, sizeof(cwd)) == NULL) {
+                    write_error();
+                    return;
+                }
+            }
+            free_deps(&deps[i]);
+            i++;
+            continue;
+        }
+
+        // extend the group until a barrier or a conflict with a line already in it
+        char* conflict = NULL;
+        int conflict_with = -1;
+        int j;
+        for (j = i + 1; j < num_lines && conflict == NULL; j++) {
+            if (check_empty_input(lines[j]) == 1) {
+                continue;
+            }
+            analyze_line(lines[j], cwd, &deps[j]);
+            if (deps[j].barrier != NULL || deps[j].unknown != NULL) {
+                free_deps(&deps[j]);
+                break;
+            }
+            int k;
+            for (k = i; k < j && conflict == NULL; k++) {
+                if (check_empty_input(lines[k]) == 0) {
+                    conflict = find_conflict(&deps[k], &deps[j]);
+                    conflict_with = k;
+                    if (conflict != NULL) {
+                        conflict = strdup(conflict);    // the sets are freed below
+                    }
+                }
+            }
+            if (conflict != NULL) {
+                free_deps(&deps[j]);
+                break;
+            }
+        }
+
+        if (shell->opt.explain) {
+            printf("stage %d: line", stage);
+            int k;
+            for (k = i; k < j; k++) {
+                if (check_empty_input(lines[k]) == 0) {
+                    printf(" %d", k + 1);
+                }
+            }
+            if (conflict != NULL) {
+                printf(" (line %d conflicts with line %d on %s)", j + 1, conflict_with + 1, conflict);
+            }
+            printf("\n");
+        }
+        else {
+            run_group(lines + i, i + 1, j - i, ctx);
+        }
+        free(conflict);
+        int k;
+        for (k = i; k < j; k++) {
+            if (check_empty_input(lines[k]) == 0) {
+                free_deps(&deps[k]);
+            }
+        }
+        i = j;
+    }
+    free(deps);
+}
+
+/*
+ *  Function:  analyze_line
+ *  --------------------
+ *  infers the files an input line reads and writes. a redirection target is
+ *  written. file arguments (arguments that are not options, since a file may not exist
+ *  until an earlier line creates it) are read, and also written unless known_commands
+ *  says the command only reads them.
+ *  commands with no file arguments that list the directory read the current directory.
+ *  built-in commands and commands marked CMD_ALONE make the line a barrier.
+ *  commands that are neither in known_commands nor marked with pure are recorded
+ *  in unknown
+ * 
+ *  input: char pointer to the input line (not changed)
+ *  cwd: directory the line runs in
+ *  deps: receives the read and write sets
+ */
+void analyze_line(char* input, char* cwd, struct line_deps* deps) {
+    deps->reads = NULL;
+    deps->num_reads = 0;
+    deps->writes = NULL;
+    deps->num_writes = 0;
+    deps->barrier = NULL;
+    deps->unknown = NULL;
+
+    char* input_cpy = strdup(input);    // parsing destroys the input
+    char** arrCmd = NULL;
+    int parallel_cmd = check_parallel(input_cpy);
+    if (parallel_cmd > 0) {
+        arrCmd = parse_cmds(input_cpy);
+    }
+    else {
+        arrCmd = malloc(2 * sizeof(char*));
+        arrCmd[0] = input_cpy;
+        arrCmd[1] = NULL;
+    }
+
+    int i;
+    for (i = 0; arrCmd[i] != NULL && parallel_cmd >= 0; i++) {
+        int redirection = check_redirect(arrCmd[i]);
+        // errors are reported when the line runs, there is nothing to schedule
+        if (redirection > 1 || redirection < 0) {
+            continue;
+        }
+        char** arr = parse_input(arrCmd[i]);
+        struct job job;
+        init_job(&job);
+        job.argv = arr;
+        if (arr[0] == NULL || parse_prefixes(&job) == -1 || arr[0] == NULL) {
+            free(job.inputs);
+            free(job.cache_env);
+            free(arr);
+            continue;
+        }
+        // declared inputs of cache are read
+        int d;
+        for (d = 0; job.inputs != NULL && job.inputs[d] != NULL; d++) {
+            add_dep(&deps->reads, &deps->num_reads, cwd, job.inputs[d]);
+        }
+        free(job.inputs);
+        free(job.cache_env);
+        if (check_command(arr) == 1) {
+            int b = 0;
+            while (strcmp(arr[0], built_in_commands[b]) != 0) {
+                b++;
+            }
+            deps->barrier = built_in_commands[b];
+            free(arr);
+            break;
+        }
+        if (redirection == 1) {
+            int file_index = count_tokens(arr) - 1;
+            add_dep(&deps->writes, &deps->num_writes, cwd, arr[file_index]);
+            arr[file_index] = NULL;
+        }
+
+        // unknown commands read the directory and read and write their file arguments
+        int flags = command_flags(arr[0]);
+        if (flags == -1) {
+            flags = CMD_READS_CWD;
+            if (deps->unknown == NULL) {
+                deps->unknown = strdup(arr[0]);
+            }
+        }
+        if (flags & CMD_ALONE) {
+            int c = 0;
+            while (strcmp(arr[0], known_commands[c].name) != 0) {
+                c++;
+            }
+            deps->barrier = known_commands[c].name;
+            free(arr);
+            break;
+        }
+
+        int file_args = 0;
+        int j;
+        for (j = 1; arr[j] != NULL; j++) {
+            // options and the arguments of pure commands such as echo are not files
+            if (arr[j][0] == '-' || ((flags & CMD_PURE) && !(flags & CMD_READS_ARGS))) {
+                continue;
+            }
+            file_args++;
+            add_dep(&deps->reads, &deps->num_reads, cwd, arr[j]);
+            if (!(flags & CMD_PURE)) {
+                add_dep(&deps->writes, &deps->num_writes, cwd, arr[j]);
+            }
+        }
+        if (file_args == 0 && (flags & CMD_READS_CWD)) {
+            add_dep(&deps->reads, &deps->num_reads, cwd, ".");
+        }
+        free(arr);
+    }
+    free(arrCmd);
+    free(input_cpy);
+}
+
+/*
+ *  Function:  add_dep
+ *  --------------------
+ *  adds the normalized path of a file to a read or write set
+ * 
+ *  set: pointer to the set
+ *  count: pointer to the number of paths in the set
+ *  cwd: directory relative paths start from
+ *  file: path of the file as written on the input line
+ */
+void add_dep(char*** set, int* count, char* cwd, char* file) {
+    *set = realloc(*set, (*count + 1) * sizeof(char*));
+    if (!*set) {
+        write_error();
+        exit(1);
+    }
+    (*set)[*count] = normalize_path(cwd, file);
+    (*count)++;
+}
+
+/*
+ *  Function:  normalize_path
+ *  --------------------
+ *  makes a path absolute and removes ., .. and repeated slashes from it,
+ *  so the same file written two ways gives the same string
+ * 
+ *  cwd: directory relative paths start from
+ *  file: the path to normalize
+ * 
+ *  returns: malloced normalized path
+ */
+char* normalize_path(char* cwd, char* file) {
+    char* joined = malloc(strlen(cwd) + strlen(file) + 2);
+    if (file[0] == '/') {
+        strcpy(joined, file);
+    }
+    else {
+        strcpy(joined, cwd);
+        strcat(joined, "/");
+        strcat(joined, file);
+    }
+
+    char* result = malloc(strlen(joined) + 2);
+    int len = 0;
+    char* component = strtok(joined, "/");
+    while (component != NULL) {
+        if (strcmp(component, "..") == 0) {
+            // remove the last component
+            while (len > 0 && result[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+        }
+        else if (strcmp(component, ".") != 0) {
+            result[len] = '/';
+            strcpy(result + len + 1, component);
+            len += strlen(component) + 1;
+        }
+        component = strtok(NULL, "/");
+    }
+    // the root directory
+    if (len == 0) {
+        result[len] = '/';
+        len++;
+    }
+    result[len] = '\0';
+    free(joined);
+    return result;
+}
+
+/*
+ *  Function:  paths_overlap
+ *  --------------------
+ *  checks if two normalized paths are the same file or one is inside the other
+ * 
+ *  returns: 1 if the paths overlap, 0 otherwise
+ */
+int paths_overlap(char* a, char* b) {
+    int len_a = strlen(a);
+    int len_b = strlen(b);
+    int len = len_a < len_b ? len_a : len_b;
+    if (strncmp(a, b, len) != 0) {
+        return 0;
+    }
+    // a/b and a/bc do not overlap, a and a/b do
+    if (len_a == len_b || len == 1) {
+        return 1;
+    }
+    return (len_a > len_b ? a[len] : b[len]) == '/';
+}
+
+/*
+ *  Function:  find_conflict
+ *  --------------------
+ *  checks if two lines can run at the same time. they conflict if one writes a
+ *  file the other reads or writes
+ * 
+ *  a, b: read and write sets of the two lines
+ * 
+ *  returns: the path of the conflicting file or NULL if there is no conflict
+ */
+char* find_conflict(struct line_deps* a, struct line_deps* b) {
+    int i, j;
+    for (i = 0; i < a->num_writes; i++) {
+        for (j = 0; j < b->num_reads; j++) {
+            if (paths_overlap(a->writes[i], b->reads[j])) {
+                return b->reads[j];
+            }
+        }
+        for (j = 0; j < b->num_writes; j++) {
+            if (paths_overlap(a->writes[i], b->writes[j])) {
+                return b->writes[j];
+            }
+        }
+    }
+    for (i = 0; i < b->num_writes; i++) {
+        for (j = 0; j < a->num_reads; j++) {
+            if (paths_overlap(b->writes[i], a->reads[j])) {
+                return b->writes[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Function:  free_deps
+ *  --------------------
+ *  frees the read and write sets of a line
+ */
+void free_deps(struct line_deps* deps) {
+    int i;
+    for (i = 0; i < deps->num_reads; i++) {
+        free(deps->reads[i]);
+    }
+    for (i = 0; i < deps->num_writes; i++) {
+        free(deps->writes[i]);
+    }
+    free(deps->reads);
+    free(deps->writes);
+    free(deps->unknown);
+}
+
+/*
+ *  Function:  run_group
+ *  --------------------
+ *  runs a group of lines that do not conflict at the same time. each line runs
+ *  in a child copy of the shell with its output captured in temporary files,
+ *  which are written out in line order once every line has finished. with --jobs,
+ *  at most that many lines run at once
+ * 
+ *  lines: the lines of the group (empty lines are skipped)
+ *  first_line: line number of the first line in the batch file
+ *  num_lines: number of lines in the group
+ *  ctx: the shell
+ */
+void run_group(char** lines, int first_line, int num_lines, struct dash_ctx* ctx) {
+    // nothing to run at the same time
+    if (num_lines == 1) {
+        run_line(lines[0], first_line, ctx);
+        return;
+    }
+
+    // if standard output and error are the same file, 1 capture file keeps them in order
+    struct stat out_stat, err_stat;
+    int same_file = fstat(STDOUT_FILENO, &out_stat) == 0 && fstat(STDERR_FILENO, &err_stat) == 0 &&
+                    out_stat.st_dev == err_stat.st_dev && out_stat.st_ino == err_stat.st_ino;
+
+    pid_t pid[num_lines];
+    FILE* out[num_lines];
+    FILE* err[num_lines];
+    long start[num_lines];
+    long end[num_lines];
+    int status[num_lines];
+    int running = 0;
+    fflush(stdout);
+    int i;
+    for (i = 0; i < num_lines; i++) {
+        pid[i] = -1;
+        end[i] = 0;
+        out[i] = NULL;
+        err[i] = NULL;
+        if (check_empty_input(lines[i]) == 1 || (shell->opt.incremental && line_is_fresh(lines[i])) ||
+                journal_done(lines[i], first_line + i)) {
+            continue;
+        }
+        start[i] = now_ns();
+        out[i] = tmpfile();
+        err[i] = same_file ? out[i] : tmpfile();
+        if (!out[i] || !err[i]) {
+            write_error();
+            continue;
+        }
+        // wait for a line to finish while the limit is reached
+        int limit = job_limit();
+        long delay = 1000000L;
+        while (limit > 0 && running >= limit) {
+            shell->pressure.held_back = 1;
+            // only the lines of the group, commands of the shell are reaped elsewhere
+            int k;
+            for (k = 0; k < i; k++) {
+                if (pid[k] > 0 && end[k] == 0 && waitpid(pid[k], &status[k], WNOHANG) != 0) {
+                    end[k] = now_ns();
+                    running--;
+                }
+            }
+            if (running >= limit) {
+                // check often at first, then every 50 ms
+                struct timespec wait = {0, delay};
+                nanosleep(&wait, NULL);
+                delay = delay * 2 < 50000000L ? delay * 2 : 50000000L;
+            }
+        }
+        pid[i] = fork();
+        if (pid[i] < 0) {
+            write_error();
+        }
+        else if (pid[i] == 0) {
+            dup2(fileno(out[i]), STDOUT_FILENO);
+            dup2(fileno(err[i]), STDERR_FILENO);
+            // the helper answers the shell only, the line forks its own commands.
+            // the line connects to the workers again (see worker_start)
+            if (backend == &spawn_backend) {
+                spawn_close();
+            }
+            // _exit, since exit would flush the batch file stream shared with the shell
+            int line_status = process(lines[i], ctx);
+            fflush(stdout);
+            _exit(line_status);
+        }
+        else {
+            running++;
+        }
+    }
+
+    for (i = 0; i < num_lines; i++) {
+        if (pid[i] > 0) {
+            if (end[i] == 0) {
+                waitpid(pid[i], &status[i], 0);
+                end[i] = now_ns();
+            }
+            int line_status = WIFEXITED(status[i]) ? WEXITSTATUS(status[i]) : 1;
+            if (shell->opt.incremental && line_status == 0) {
+                record_fresh(lines[i]);
+            }
+            journal_record(lines[i], first_line + i, line_status, end[i] - start[i]);
+            if (shell->opt.report) {
+                report_add_line(lines[i], first_line + i, shell->num_report_groups + 1, end[i] - start[i],
+                                line_status);
+            }
+        }
+        if (out[i]) {
+            copy_output(out[i], STDOUT_FILENO);
+            fclose(out[i]);
+        }
+        if (err[i] && err[i] != out[i]) {
+            copy_output(err[i], STDERR_FILENO);
+            fclose(err[i]);
+        }
+    }
+    shell->num_report_groups++;
+}
+
+/*
+ *  Function:  copy_output
+ *  --------------------
+ *  writes everything in a capture file to a file descriptor
+ * 
+ *  from: capture file
+ *  to: file descriptor to write to
+ */
+void copy_output(FILE* from, int to) {
+    char buf[BUF_SIZE];
+    ssize_t n;
+    lseek(fileno(from), 0, SEEK_SET);
+    while ((n = read(fileno(from), buf, sizeof(buf))) > 0) {
+        write(to, buf, n);
+    }
+}
+
+/*
+ *  Function:  check_write_conflicts
+ *  --------------------
+ *  finds commands on one line that redirect to the same file. the target of every
+ *  redirection is resolved to its device and inode (or the device and inode of its
+ *  directory and its name if it does not exist yet), so different spellings of the
+ *  same path are caught. --redirect-policy decides what happens to the conflicting
+ *  commands: they are serialized (after is set), the later ones are skipped with an
+ *  error, or the earlier ones are skipped. relative targets are resolved in the
+ *  directory the command will run in (see scope_dirs)
+ * 
+ *  jobs[]: array of parsed jobs on the line
+ *  num_jobs: the number of jobs
+ */
+void check_write_conflicts(struct job jobs[], int num_jobs) {
+    if (num_jobs < 2) {
+        return;
+    }
+    struct stat targets[num_jobs];
+    char* names[num_jobs];  // name inside the directory if the target does not exist yet
+    int resolved[num_jobs]; // 1 if targets[i] holds the target of jobs[i]
+    int i, j;
+    for (i = 0; i < num_jobs; i++) {
+        names[i] = NULL;
+        resolved[i] = 0;
+        if (jobs[i].skip) {
+            continue;
+        }
+        // relative targets are resolved in the directory the command runs in
+        int dir_fd = jobs[i].dir_fd != -1 ? jobs[i].dir_fd : AT_FDCWD;
+        if (jobs[i].redirection != 1 || check_command(jobs[i].argv) == 1) {
+            continue;
+        }
+        char* target = jobs[i].argv[count_tokens(jobs[i].argv) - 1];
+        if (fstatat(dir_fd, target, &targets[i], 0) == -1) {
+            // the file is created by the redirection, so identify it by directory and name
+            char* slash = strrchr(target, '/');
+            char* dir = slash == NULL ? strdup(".") : strndup(target, slash - target + 1);
+            names[i] = slash == NULL ? target : slash + 1;
+            // the open will fail anyway
+            if (fstatat(dir_fd, dir, &targets[i], 0) == -1) {
+                free(dir);
+                continue;
+            }
+            free(dir);
+        }
+
+        resolved[i] = 1;
+
+        // find the closest earlier command writing the same file
+        for (j = i - 1; j >= 0; j--) {
+            if (resolved[j] && !jobs[j].skip && same_target(&targets[i], names[i], &targets[j], names[j])) {
+                break;
+            }
+        }
+        if (j < 0) {
+            continue;
+        }
+        if (shell->opt.redirect_policy == POLICY_ERROR) {
+            write_error();
+            jobs[i].skip = 1;
+        }
+        else if (shell->opt.redirect_policy == POLICY_LAST) {
+            jobs[j].skip = 1;
+        }
+        else {
+            jobs[i].after = j;
+        }
+    }
+}
+
+/*
+ *  Function:  same_target
+ *  --------------------
+ *  checks if two resolved redirection targets are the same file
+ * 
+ *  a, b: stat of the file, or of its directory if it does not exist yet
+ *  name_a, name_b: name inside the directory, NULL if the file exists
+ * 
+ *  returns: 1 if they are the same file, 0 otherwise
+ */
+int same_target(struct stat* a, char* name_a, struct stat* b, char* name_b) {
+    if (a->st_dev != b->st_dev || a->st_ino != b->st_ino) {
+        return 0;
+    }
+    if (name_a == NULL || name_b == NULL) {
+        return name_a == name_b;
+    }
+    return strcmp(name_a, name_b) == 0;
+}
+
+/*
+ *  Function:  dedup_jobs
+ *  --------------------
+ *  finds side-effect-free commands (see is_pure) that are repeated on one line with
+ *  the same arguments, prefixes and redirection target, in the same directory and
+ *  with the same path. only the first one runs, the others are skipped and get its
+ *  result. commands writing to the screen are not merged, since each one has to
+ *  print, and neither are 2 commands with a command writing their target between them
+ * 
+ *  jobs[]: array of parsed jobs on the line
+ *  num_jobs: the number of jobs
+ */
+void dedup_jobs(struct job jobs[], int num_jobs) {
+    int i, j;
+    for (i = 1; i < num_jobs; i++) {
+        if (jobs[i].skip || jobs[i].redirection != 1 || check_command(jobs[i].argv) == 1 ||
+                !is_pure(jobs[i].argv[0])) {
+            continue;
+        }
+        char* target = jobs[i].argv[count_tokens(jobs[i].argv) - 1];
+        // the closest earlier twin, the file would not be the same past another writer
+        for (j = i - 1; j >= 0; j--) {
+            if (jobs[j].skip) {
+                continue;
+            }
+            if (jobs[j].generation == jobs[i].generation && jobs[j].redirection == 1 &&
+                    jobs[j].dir_fd == jobs[i].dir_fd && jobs[j].path == jobs[i].path &&
+                    same_tokens(jobs[j].argv, jobs[i].argv) && same_prefixes(&jobs[j], &jobs[i])) {
+                jobs[i].dup_of = j;
+                jobs[i].skip = 1;
+                break;
+            }
+            if (writes_target(&jobs[j], target)) {
+                break;
+            }
+        }
+    }
+}
+
+/*
+ *  Function:  same_tokens
+ *  --------------------
+ *  compares 2 NULL terminated token arrays, either of which may be NULL (no tokens)
+ * 
+ *  returns: 1 if they have the same tokens, 0 otherwise
+ */
+int same_tokens(char** a, char** b) {
+    int k;
+    for (k = 0; a != NULL && b != NULL && a[k] != NULL && b[k] != NULL; k++) {
+        if (strcmp(a[k], b[k]) != 0) {
+            return 0;
+        }
+    }
+    return (a == NULL || a[k] == NULL) && (b == NULL || b[k] == NULL);
+}
+
+/*
+ *  Function:  same_prefixes
+ *  --------------------
+ *  compares what the prefixes of 2 jobs set (see parse_prefixes)
+ * 
+ *  returns: 1 if the 2 commands would run the same way, 0 otherwise
+ */
+int same_prefixes(struct job* a, struct job* b) {
+    if (a->cache != b->cache || !same_tokens(a->inputs, b->inputs) || !same_tokens(a->cache_env, b->cache_env) ||
+            a->has_cpus != b->has_cpus || (a->has_cpus && !CPU_EQUAL(&a->cpus, &b->cpus)) ||
+            a->limit_set != b->limit_set || a->has_nice != b->has_nice || a->nice != b->nice ||
+            a->ioprio != b->ioprio || a->sem_slots != b->sem_slots) {
+        return 0;
+    }
+    int l;
+    for (l = 0; l < NUM_LIMITS; l++) {
+        if ((a->limit_set & (1 << l)) && a->limits[l] != b->limits[l]) {
+            return 0;
+        }
+    }
+    if (a->sem_name == NULL || b->sem_name == NULL) {
+        return a->sem_name == b->sem_name;
+    }
+    return strcmp(a->sem_name, b->sem_name) == 0;
+}
+
+/*
+ *  Function:  writes_target
+ *  --------------------
+ *  checks if a job may write a file: it is redirected to it, or it has side effects
+ *  and names it as an argument
+ * 
+ *  job: the job
+ *  target: the file, as written on the line
+ * 
+ *  returns: 1 if the job may write the file, 0 otherwise
+ */
+int writes_target(struct job* job, char* target) {
+    if (job->argv == NULL || job->argv[0] == NULL) {
+        return 0;
+    }
+    int len = count_tokens(job->argv);
+    if (job->redirection == 1 && strcmp(job->argv[len - 1], target) == 0) {
+        return 1;
+    }
+    if (is_pure(job->argv[0])) {
+        return 0;
+    }
+    int k;
+    for (k = 1; k < len; k++) {
+        if (strcmp(job->argv[k], target) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Function:  is_pure
+ *  --------------------
+ *  checks if a command has no side effects other than its output,
+ *  either because known_commands says so or because it was marked with pure
+ * 
+ *  command: name of the command
+ * 
+ *  returns: 1 if the command is side-effect-free, 0 otherwise
+ */
+int is_pure(char* command) {
+    int flags = command_flags(command);
+    return flags != -1 && (flags & CMD_PURE) != 0;
+}
+
+/*
+ *  Function:  command_flags
+ *  --------------------
+ *  finds what a command does with its arguments and the current directory (see
+ *  known_commands). commands marked with pure may read their file arguments and the
+ *  current directory
+ * 
+ *  command: name of the command
+ * 
+ *  returns: the CMD_ flags of the command, -1 if it is unknown
+ */
+int command_flags(char* command) {
+    int num_known = sizeof(known_commands) / sizeof(struct cmd_info);
+    int i;
+    for (i = 0; i < num_known; i++) {
+        if (strcmp(command, known_commands[i].name) == 0) {
+            return known_commands[i].flags;
+        }
+    }
+    for (i = 0; i < shell->num_pure_commands; i++) {
+        if (strcmp(command, shell->pure_commands[i]) == 0) {
+            return CMD_PURE | CMD_READS_ARGS | CMD_READS_CWD;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Function:  dash_pure
+ *  --------------------
+ *  built-in implementation of pure command. marks the commands given as
+ *  arguments as side-effect-free, or prints the marked commands if there are none
+ * 
+ *  arrTok: char** that has been tokenized
+ */
+void dash_pure(char** arrTok) {
+    int i;
+    if (arrTok[1] == NULL) {
+        for (i = 0; i < shell->num_pure_commands; i++) {
+            printf("%s\n", shell->pure_commands[i]);
+        }
+        fflush(stdout);
+        return;
+    }
+    int args = count_tokens(arrTok) - 1;
+    shell->pure_commands = realloc(shell->pure_commands, (shell->num_pure_commands + args) * sizeof(char*));
+    if (!shell->pure_commands) {
+        write_error();
+        exit(1);
+    }
+    for (i = 1; i <= args; i++) {
+        // the tokens point into the input line, which is not kept
+        shell->pure_commands[shell->num_pure_commands] = strdup(arrTok[i]);
+        shell->num_pure_commands++;
+    }
+}
+
+/*
+ *  Function:  init_job
+ *  --------------------
+ *  sets every field of a job to its default (a job that is not run)
+ * 
+ *  job: the job to initialize
+ */
+void init_job(struct job* job) {
+    job->argv = NULL;
+    job->redirection = -1;
+    job->pid = -1;
+    job->state = JOB_PENDING;
+    job->queued = 0;
+    job->start = 0;
+    job->forked = 0;
+    job->execed = 0;
+    job->end = 0;
+    job->user_us = 0;
+    job->system_us = 0;
+    job->max_rss = 0;
+    job->predicted = -1;
+    job->predicted_rss = -1;
+    job->after = -1;
+    job->skip = 1;
+    job->dup_of = -1;
+    job->generation = 0;
+    job->status = 0;
+    job->cache = 0;
+    job->inputs = NULL;
+    job->cache_env = NULL;
+    job->cache_key = 0;
+    job->cache_target = NULL;
+    job->has_cpus = 0;
+    job->cpu = -1;
+    job->limit_set = 0;
+    job->has_nice = 0;
+    job->nice = 0;
+    job->ioprio = -1;
+    job->dir_fd = -1;
+    job->path = NULL;
+    job->sem_name = NULL;
+    job->sem_slots = 0;
+    job->error = NULL;
+}
+
+/*
+ *  Function:  parse_prefixes
+ *  --------------------
+ *  removes prefix commands from the front of a job's tokens and records them in the job.
+ *  the remaining tokens are moved to the start of argv.
+ *      cache [-i file]... [-e variable]... command
+ *  caches the output of the command. -i declares an input file and -e an environment
+ *  variable the output depends on (see cache_key). cache stats is the cache built-in
+ *      affinity cpulist command
+ *  runs the command on the CPUs in the list (ex. 0-3,8). affinity with no command
+ *  is the affinity built-in
+ *      limit name=value... command
+ *  runs the command with resource limits (see limit_names, ex. limit cpu=10 mem=512M)
+ *      nice n command
+ *      ionice class command
+ *  add n to the niceness of the command, or set its I/O priority (see parse_ioprio).
+ *  nice and ionice with no command after them set the default of the commands after
+ *  them on the line (see process). nice and ionice with other arguments (ex. nice -n 5)
+ *  are the nice and ionice programs
+ *      sem name n command
+ *  runs the command once fewer than n commands hold the semaphore name, counting
+ *  every dash on the machine (see sem_acquire)
+ * 
+ *  job: the job, with argv set
+ * 
+ *  returns: 0 if the prefixes are valid, -1 otherwise
+ */
+int parse_prefixes(struct job* job) {
+    char** argv = job->argv;
+    int start = 0;
+    while (argv[start] != NULL) {
+        // cache stats (or cache alone) is the built-in command
+        if (strcmp(argv[start], built_in_commands[4]) == 0 && argv[start + 1] != NULL &&
+                strcmp(argv[start + 1], "stats") != 0) {
+            job->cache = 1;
+            start++;
+            int max = count_tokens(argv + start) + 1;
+            free(job->inputs);
+            free(job->cache_env);
+            job->inputs = malloc(max * sizeof(char*));
+            job->cache_env = malloc(max * sizeof(char*));
+            int num_inputs = 0;
+            int num_env = 0;
+            while (argv[start] != NULL && (strcmp(argv[start], "-i") == 0 || strcmp(argv[start], "-e") == 0)) {
+                if (argv[start + 1] == NULL) {
+                    return -1;
+                }
+                if (argv[start][1] == 'i') {
+                    job->inputs[num_inputs] = argv[start + 1];
+                    num_inputs++;
+                }
+                else {
+                    job->cache_env[num_env] = argv[start + 1];
+                    num_env++;
+                }
+                start += 2;
+            }
+            job->inputs[num_inputs] = NULL;
+            job->cache_env[num_env] = NULL;
+            // there has to be a command after the prefix
+            if (argv[start] == NULL) {
+                return -1;
+            }
+        }
+        // affinity with a list and a command, affinity alone is the built-in command
+        else if (strcmp(argv[start], built_in_commands[5]) == 0 && argv[start + 1] != NULL &&
+                argv[start + 2] != NULL) {
+            if (parse_cpu_list(argv[start + 1], &job->cpus) == -1) {
+                return -1;
+            }
+            job->has_cpus = 1;
+            start += 2;
+        }
+        else if (strcmp(argv[start], "limit") == 0) {
+            start++;
+            int index;
+            rlim_t value;
+            if (argv[start] == NULL || strchr(argv[start], '=') == NULL) {
+                return -1;
+            }
+            while (argv[start] != NULL && strchr(argv[start], '=') != NULL) {
+                if (parse_limit(argv[start], &index, &value) == -1) {
+                    return -1;
+                }
+                job->limit_set |= 1 << index;
+                job->limits[index] = value;
+                start++;
+            }
+            if (argv[start] == NULL) {
+                return -1;
+            }
+        }
+        else if (strcmp(argv[start], "nice") == 0 && argv[start + 1] != NULL) {
+            char* end;
+            long n = strtol(argv[start + 1], &end, 10);
+            if (end == argv[start + 1] || *end != '\0') {
+                break;
+            }
+            job->has_nice = 1;
+            job->nice = n < -40 ? -40 : n > 40 ? 40 : n;
+            start += 2;
+        }
+        else if (strcmp(argv[start], "sem") == 0) {
+            if (argv[start + 1] == NULL || argv[start + 2] == NULL || argv[start + 3] == NULL ||
+                    strchr(argv[start + 1], '/') != NULL) {
+                return -1;
+            }
+            char* end;
+            long slots = strtol(argv[start + 2], &end, 10);
+            if (end == argv[start + 2] || *end != '\0' || slots <= 0 || slots > 4096) {
+                return -1;
+            }
+            job->sem_name = argv[start + 1];
+            job->sem_slots = slots;
+            start += 3;
+        }
+        else if (strcmp(argv[start], "ionice") == 0 && argv[start + 1] != NULL &&
+                parse_ioprio(argv[start + 1], &job->ioprio) == 0) {
+            start += 2;
+        }
+        else {
+            break;
+        }
+    }
+    // move the command to the front
+    memmove(argv, argv + start, (count_tokens(argv + start) + 1) * sizeof(char*));
+    return 0;
+}
+
+/*
+ *  Function:  parse_size
+ *  --------------------
+ *  parses a size in bytes with an optional K, M or G suffix (ex. 512M)
+ * 
+ *  value: the size as written
+ * 
+ *  returns: the size in bytes, or -1 if it is not a valid size
+ */
+long parse_size(char* value) {
+    char* end;
+    long size = strtol(value, &end, 10);
+    if (end == value || size < 0) {
+        return -1;
+    }
+    switch (toupper(*end)) {
+        case 'G':
+            size *= 1024;
+            /* fall through */
+        case 'M':
+            size *= 1024;
+            /* fall through */
+        case 'K':
+            size *= 1024;
+            end++;
+            break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    return size;
+}
+
+/*
+ *  Function:  cache_dir
+ *  --------------------
+ *  finds the result cache directory and creates it if needed. it is the --cache-dir
+ *  directory, or cache in dash_dir if the cache prefix is used without --cache-dir,
+ *  so the results are kept apart from the history and semaphore files
+ * 
+ *  returns: path of the directory
+ */
+char* cache_dir() {
+    static char dir[PATH_MAX];
+    if (dir[0] == '\0') {
+        if (shell->opt.cache_dir != NULL) {
+            snprintf(dir, sizeof(dir), "%s", shell->opt.cache_dir);
+        }
+        else if (snprintf(dir, sizeof(dir), "%s/cache", dash_dir()) >= (int)sizeof(dir)) {
+            // too long a home directory, share dash_dir (is_cache_entry keeps the other files)
+            snprintf(dir, sizeof(dir), "%s", dash_dir());
+        }
+        mkdir(dir, S_IRWXU);
+    }
+    return dir;
+}
+
+/*
+ *  Function:  is_cache_entry
+ *  --------------------
+ *  checks if a file in the cache directory is a result, named by its key in 16 hex
+ *  digits (see cache_store). other files are left alone, since --cache-dir may be
+ *  a directory that is also used for something else
+ * 
+ *  name: name of the file
+ * 
+ *  returns: 1 if the file is a result, 0 otherwise
+ */
+int is_cache_entry(char* name) {
+    int i;
+    for (i = 0; i < 16; i++) {
+        if (!isxdigit((unsigned char)name[i])) {
+            return 0;
+        }
+    }
+    return name[16] == '\0';
+}
+
+/*
+ *  Function:  hash_bytes
+ *  --------------------
+ *  adds bytes to a 64-bit FNV-1a hash
+ * 
+ *  hash: hash so far
+ *  data: bytes to add
+ *  len: number of bytes
+ * 
+ *  returns: the new hash
+ */
+unsigned long hash_bytes(unsigned long hash, void* data, size_t len) {
+    unsigned char* bytes = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/*
+ *  Function:  hash_string
+ *  --------------------
+ *  adds a string and its terminating \0 to a hash, so ab c and a bc differ
+ */
+unsigned long hash_string(unsigned long hash, char* str) {
+    return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+/*
+ *  Function:  cache_key
+ *  --------------------
+ *  computes the key of a command's result. it covers the tokens (not the redirection
+ *  target), the current directory, the path, the environment variables selected with
+ *  cache -e and the path, modification time, size and inode of the input files, which
+ *  are the files declared with cache -i and the arguments naming existing files. for
+ *  directories (the arguments naming one, and the current directory of commands that
+ *  read it) the modification time and inode stand for the list of their files
+ * 
+ *  job: the job to compute the key of
+ *  path: the current path
+ * 
+ *  returns: the key (never 0)
+ */
+unsigned long cache_key(struct job* job, char** path) {
+    unsigned long hash = 14695981039346656037UL;
+    int len = count_tokens(job->argv) - 1;  // the last token is the redirection target
+    int i;
+    for (i = 0; i < len; i++) {
+        hash = hash_string(hash, job->argv[i]);
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        hash = hash_string(hash, cwd);
+    }
+    for (i = 0; path[i] != NULL; i++) {
+        hash = hash_string(hash, path[i]);
+    }
+    for (i = 0; job->cache_env != NULL && job->cache_env[i] != NULL; i++) {
+        char* value = getenv(job->cache_env[i]);
+        hash = hash_string(hash, job->cache_env[i]);
+        hash = hash_string(hash, value != NULL ? value : "");
+    }
+
+    // declared inputs first, then arguments that name existing files
+    int num_inputs = job->inputs != NULL ? count_tokens(job->inputs) : 0;
+    for (i = 0; i < num_inputs + len; i++) {
+        char* file = i < num_inputs ? job->inputs[i] : job->argv[i - num_inputs];
+        struct stat st;
+        if (stat(file, &st) == -1) {
+            // a missing declared input is part of the key, other arguments are not files
+            if (i < num_inputs) {
+                hash = hash_string(hash, file);
+            }
+            continue;
+        }
+        if (i >= num_inputs && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        hash = hash_string(hash, file);
+        hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+        hash = hash_bytes(hash, &st.st_size, sizeof(st.st_size));
+        hash = hash_bytes(hash, &st.st_ino, sizeof(st.st_ino));
+    }
+    // adding or removing a file changes the modification time of its directory
+    int flags = command_flags(job->argv[0]);
+    struct stat st;
+    if (flags != -1 && (flags & CMD_READS_CWD) && stat(".", &st) == 0) {
+        hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+        hash = hash_bytes(hash, &st.st_ino, sizeof(st.st_ino));
+    }
+    return hash != 0 ? hash : 1;
+}
+
+/*
+ *  Function:  cache_lookup
+ *  --------------------
+ *  looks for the result of a redirected command in the cache. on a hit the cached
+ *  output is copied (or reflinked) to the redirection target and the command does
+ *  not need to run. on a miss the key is kept in the job so the output can be
+ *  stored once the command succeeds
+ * 
+ *  job: the job about to run
+ *  path: the current path
+ * 
+ *  returns: 1 on a hit, 0 if the command has to run
+ */
+int cache_lookup(struct job* job, char** path) {
+    if (job->redirection != 1) {
+        return 0;
+    }
+    char* target = job->argv[count_tokens(job->argv) - 1];
+    unsigned long key = cache_key(job, path);
+    char entry[PATH_MAX + CACHE_NAME_MAX];
+    snprintf(entry, sizeof(entry), "%s/%016lx", cache_dir(), key);
+
+    int from = open(entry, O_RDONLY);
+    if (from != -1) {
+        int to = open(target, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU);
+        if (to != -1 && clone_file(from, to) == 0) {
+            close(to);
+            close(from);
+            utimensat(AT_FDCWD, entry, NULL, 0);    // recently used results are evicted last
+            shell->cache_counts.hits++;
+            job->status = 0;
+            return 1;
+        }
+        if (to != -1) {
+            close(to);
+        }
+        close(from);
+    }
+    shell->cache_counts.misses++;
+    job->cache_key = key;
+    // a cd later on the line must not change where the output is read from
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        job->cache_target = normalize_path(cwd, target);
+    }
+    return 0;
+}
+
+/*
+ *  Function:  cache_store
+ *  --------------------
+ *  copies the redirection target of a successful command into the cache.
+ *  the copy is written to a temporary name and renamed, so other dash
+ *  processes never see a partial result
+ * 
+ *  job: the job that finished, with cache_key and cache_target set
+ */
+void cache_store(struct job* job) {
+    if (job->cache_target == NULL) {
+        return;
+    }
+    char* dir = cache_dir();
+    char entry[PATH_MAX + CACHE_NAME_MAX];
+    char tmp[PATH_MAX + CACHE_NAME_MAX];
+    snprintf(entry, sizeof(entry), "%s/%016lx", dir, job->cache_key);
+    snprintf(tmp, sizeof(tmp), "%s/.tmp.%d.%016lx", dir, getpid(), job->cache_key);
+    int from = open(job->cache_target, O_RDONLY);
+    if (from == -1) {
+        return;
+    }
+    int to = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (to == -1) {
+        close(from);
+        return;
+    }
+    int copied = clone_file(from, to);
+    close(to);
+    close(from);
+    if (copied == 0 && rename(tmp, entry) == 0) {
+        shell->cache_counts.stores++;
+        cache_evict(dir);
+    }
+    else {
+        unlink(tmp);
+    }
+}
+
+/*
+ *  Function:  compare_entries
+ *  --------------------
+ *  qsort comparison putting the least recently used cache entries first
+ */
+int compare_entries(const void* a, const void* b) {
+    const struct cache_entry* entry_a = a;
+    const struct cache_entry* entry_b = b;
+    return (entry_a->used > entry_b->used) - (entry_a->used < entry_b->used);
+}
+
+/*
+ *  Function:  cache_evict
+ *  --------------------
+ *  removes the least recently used results until the cache fits in --cache-size
+ * 
+ *  dir: the cache directory
+ */
+void cache_evict(char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct cache_entry* entries = NULL;
+    int num_entries = 0;
+    long total = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        struct stat st;
+        // temporary files of stores in progress start with ., so they are skipped too
+        if (!is_cache_entry(ent->d_name) || fstatat(dirfd(d), ent->d_name, &st, 0) == -1) {
+            continue;
+        }
+        entries = realloc(entries, (num_entries + 1) * sizeof(struct cache_entry));
+        strcpy(entries[num_entries].name, ent->d_name);
+        entries[num_entries].size = st.st_size;
+        entries[num_entries].used = st.st_mtime;
+        total += st.st_size;
+        num_entries++;
+    }
+    if (total > shell->opt.cache_size) {
+        qsort(entries, num_entries, sizeof(struct cache_entry), compare_entries);
+        int i;
+        for (i = 0; i < num_entries && total > shell->opt.cache_size; i++) {
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+                shell->cache_counts.evictions++;
+            }
+        }
+    }
+    free(entries);
+    closedir(d);
+}
+
+/*
+ *  Function:  clone_file
+ *  --------------------
+ *  copies a file. a reflink is tried first (no data is copied on file systems that
+ *  share blocks), then copy_file_range, then read and write
+ * 
+ *  from: file descriptor to copy from
+ *  to: file descriptor to copy to
+ * 
+ *  returns: 0 on success, -1 on error
+ */
+int clone_file(int from, int to) {
+    if (ioctl(to, FICLONE, from) == 0) {
+        return 0;
+    }
+    ssize_t n;
+    while ((n = copy_file_range(from, NULL, to, NULL, 1L << 30, 0)) > 0) {}
+    if (n == 0) {
+        return 0;
+    }
+    // not supported between these files, continue from where copy_file_range stopped
+    char buf[BUF_SIZE];
+    while ((n = read(from, buf, sizeof(buf))) > 0) {
+        if (write(to, buf, n) != n) {
+            return -1;
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/*
+ *  Function:  dash_cache
+ *  --------------------
+ *  built-in implementation of cache stats, which prints the cache counters of this
+ *  shell and the number and size of the results in the cache directory
+ * 
+ *  arrTok: char** that has been tokenized
+ */
+void dash_cache(char** arrTok) {
+    if (count_tokens(arrTok) != 2) {
+        write_error();
+        return;
+    }
+    char* dir = cache_dir();
+    int entries = 0;
+    long bytes = 0;
+    DIR* d = opendir(dir);
+    struct dirent* ent;
+    while (d != NULL && (ent = readdir(d)) != NULL) {
+        struct stat st;
+        if (is_cache_entry(ent->d_name) && fstatat(dirfd(d), ent->d_name, &st, 0) == 0) {
+            entries++;
+            bytes += st.st_size;
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    printf("hits %d\nmisses %d\nstores %d\nevictions %d\nentries %d\nbytes %ld\nlimit %ld\n",
+           shell->cache_counts.hits, shell->cache_counts.misses, shell->cache_counts.stores, shell->cache_counts.evictions,
+           entries, bytes, shell->opt.cache_size);
+    fflush(stdout);
+}
+
+/*
+ *  Function:  run_line
+ *  --------------------
+ *  runs 1 line of a batch file. with --incremental, a line whose outputs are up to
+ *  date is skipped (see line_is_fresh) and a line that succeeds is recorded in the index.
+ *  with --journal, the line is recorded in the journal once it has finished, and with
+ *  --resume a line the journal says has finished is skipped
+ * 
+ *  input: char pointer to the input line
+ *  line_number: number of the line in the batch file, starting at 1
+ *  ctx: the shell
+ * 
+ *  returns: the status returned by process, 0 if the line was skipped
+ */
+int run_line(char* input, int line_number, struct dash_ctx* ctx) {
+    shell->current_line = line_number;
+    if (!shell->opt.incremental && shell->opt.journal == NULL) {
+        return process(input, ctx);
+    }
+    if ((shell->opt.incremental && line_is_fresh(input)) || journal_done(input, line_number)) {
+        return 0;
+    }
+    char* input_cpy = strdup(input);    // process destroys the input
+    long start = now_ns();
+    int status = process(input, ctx);
+    if (shell->opt.incremental && status == 0) {
+        record_fresh(input_cpy);
+    }
+    journal_record(input_cpy, line_number, status, now_ns() - start);
+    free(input_cpy);
+    return status;
+}
+
+/*
+ *  Function:  hash_line
+ *  --------------------
+ *  hashes the text of an input line, ignoring how much whitespace separates the words
+ * 
+ *  input: char pointer to the input line
+ * 
+ *  returns: the hash
+ */
+unsigned long hash_line(char* input) {
+    unsigned long hash = 14695981039346656037UL;
+    int in_space = 1;
+    for (; *input != '\0'; input++) {
+        if (isspace(*input)) {
+            in_space = 1;
+            continue;
+        }
+        if (in_space) {
+            hash = hash_bytes(hash, " ", 1);
+            in_space = 0;
+        }
+        hash = hash_bytes(hash, input, 1);
+    }
+    return hash;
+}
+
+/*
+ *  Function:  line_is_fresh
+ *  --------------------
+ *  checks if a line can be skipped in --incremental mode. like make, it can be
+ *  skipped if every file it writes (see analyze_line) exists, is at least as new as
+ *  every file it reads and was last produced by the same command text. lines that
+ *  write nothing and barriers always run
+ * 
+ *  input: char pointer to the input line (not changed)
+ * 
+ *  returns: 1 if the line can be skipped, 0 otherwise
+ */
+int line_is_fresh(char* input) {
+    char cwd[PATH_MAX];
+    if (check_empty_input(input) == 1 || getcwd(cwd, sizeof(cwd)) == NULL) {
+        return 0;
+    }
+    struct line_deps deps;
+    analyze_line(input, cwd, &deps);
+    int fresh = deps.barrier == NULL && deps.num_writes > 0;
+    unsigned long text = hash_line(input);
+    int i, j;
+    for (i = 0; i < deps.num_writes && fresh; i++) {
+        struct stat out;
+        if (stat(deps.writes[i], &out) == -1) {
+            fresh = 0;
+            break;
+        }
+        unsigned long target = hash_string(14695981039346656037UL, deps.writes[i]);
+        for (j = 0; j < shell->fresh_size; j++) {
+            if (shell->fresh_index[j].target == target) {
+                break;
+            }
+        }
+        if (j == shell->fresh_size || shell->fresh_index[j].text != text) {
+            fresh = 0;
+            break;
+        }
+        for (j = 0; j < deps.num_reads; j++) {
+            struct stat in;
+            // arguments that are not files are not inputs
+            if (stat(deps.reads[j], &in) == -1) {
+                continue;
+            }
+            if (in.st_mtim.tv_sec > out.st_mtim.tv_sec ||
+                    (in.st_mtim.tv_sec == out.st_mtim.tv_sec && in.st_mtim.tv_nsec > out.st_mtim.tv_nsec)) {
+                fresh = 0;
+                break;
+            }
+        }
+    }
+    free_deps(&deps);
+    return fresh;
+}
+
+/*
+ *  Function:  record_fresh
+ *  --------------------
+ *  records in the --incremental index that the outputs of a line that succeeded
+ *  were produced by its command text
+ * 
+ *  input: char pointer to the input line as it was before it ran
+ */
+void record_fresh(char* input) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return;
+    }
+    struct line_deps deps;
+    analyze_line(input, cwd, &deps);
+    unsigned long text = hash_line(input);
+    int i, j;
+    for (i = 0; i < deps.num_writes && deps.barrier == NULL; i++) {
+        unsigned long target = hash_string(14695981039346656037UL, deps.writes[i]);
+        for (j = 0; j < shell->fresh_size; j++) {
+            if (shell->fresh_index[j].target == target) {
+                break;
+            }
+        }
+        if (j == shell->fresh_size) {
+            shell->fresh_index = realloc(shell->fresh_index, (shell->fresh_size + 1) * sizeof(struct fresh_entry));
+            shell->fresh_size++;
+        }
+        shell->fresh_index[j].target = target;
+        shell->fresh_index[j].text = text;
+    }
+    free_deps(&deps);
+}
+
+/*
+ *  Function:  load_index
+ *  --------------------
+ *  reads the --incremental index. it is a file with the 8 byte header DASHIDX1
+ *  followed by fresh_entry records. a missing or damaged index is treated as empty,
+ *  so every line runs
+ */
+void load_index() {
+    // make the name absolute so a cd in the batch file does not move the index
+    char cwd[PATH_MAX];
+    if (shell->opt.index_file[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+        shell->opt.index_file = normalize_path(cwd, shell->opt.index_file);
+    }
+    int fd = open(shell->opt.index_file, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    char header[8];
+    struct stat st;
+    if (read(fd, header, 8) == 8 && memcmp(header, "DASHIDX1", 8) == 0 && fstat(fd, &st) == 0) {
+        shell->fresh_size = (st.st_size - 8) / sizeof(struct fresh_entry);
+        shell->fresh_index = malloc((shell->fresh_size + 1) * sizeof(struct fresh_entry));
+        ssize_t len = shell->fresh_size * sizeof(struct fresh_entry);
+        if (read(fd, shell->fresh_index, len) != len) {
+            shell->fresh_size = 0;
+        }
+    }
+    close(fd);
+}
+
+/*
+ *  Function:  save_index
+ *  --------------------
+ *  writes the --incremental index to a temporary file and renames it over the
+ *  old one, so an interrupted write never leaves a damaged index
+ */
+void save_index() {
+    if (getpid() != shell_pid) {
+        return;
+    }
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d", shell->opt.index_file, getpid());
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        return;
+    }
+    ssize_t len = shell->fresh_size * sizeof(struct fresh_entry);
+    if (write(fd, "DASHIDX1", 8) == 8 && write(fd, shell->fresh_index, len) == len) {
+        close(fd);
+        rename(tmp, shell->opt.index_file);
+    }
+    else {
+        close(fd);
+        unlink(tmp);
+    }
+}
+
+/*
+ *  Function:  now_ns
+ *  --------------------
+ *  reads the monotonic clock
+ * 
+ *  returns: the time in nanoseconds
+ */
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ *  Function:  open_journal
+ *  --------------------
+ *  opens the --journal file. it is the 8 byte header DASHJNL1 followed by
+ *  journal_entry records. with --resume the records of the earlier run are read
+ *  and new records are appended, otherwise the journal starts empty
+ */
+void open_journal() {
+    int flags = O_RDWR | O_CREAT | O_APPEND;
+    if (!shell->opt.resume) {
+        flags |= O_TRUNC;
+    }
+    shell->journal_fd = open(shell->opt.journal, flags, S_IRUSR | S_IWUSR);
+    if (shell->journal_fd == -1) {
+        write_error();
+        exit(1);
+    }
+    char header[8];
+    struct stat st;
+    if (read(shell->journal_fd, header, 8) == 8 && memcmp(header, "DASHJNL1", 8) == 0 && fstat(shell->journal_fd, &st) == 0) {
+        shell->num_finished = (st.st_size - 8) / sizeof(struct journal_entry);
+        shell->finished = malloc((shell->num_finished + 1) * sizeof(struct journal_entry));
+        // a record cut short by a crash is ignored
+        ssize_t len = shell->num_finished * sizeof(struct journal_entry);
+        if (read(shell->journal_fd, shell->finished, len) != len) {
+            shell->num_finished = 0;
+        }
+        if (ftruncate(shell->journal_fd, 8 + shell->num_finished * sizeof(struct journal_entry)) == -1) {
+            write_error();
+        }
+    }
+    // new or damaged journal
+    else if (ftruncate(shell->journal_fd, 0) == -1 || write(shell->journal_fd, "DASHJNL1", 8) != 8) {
+        write_error();
+        exit(1);
+    }
+    shell->last_sync = now_ns();
+}
+
+/*
+ *  Function:  journal_done
+ *  --------------------
+ *  checks if --resume can skip a line because the journal says the same command
+ *  text already finished with status 0 at that line number, so failed lines are
+ *  tried again. lines with built-in commands always run again, since the directory
+ *  and path they set are not in the journal
+ * 
+ *  input: char pointer to the input line (not changed)
+ *  line_number: number of the line in the batch file
+ * 
+ *  returns: 1 if the line can be skipped, 0 otherwise
+ */
+int journal_done(char* input, int line_number) {
+    if (!shell->opt.resume || shell->num_finished == 0) {
+        return 0;
+    }
+    unsigned long text = hash_line(input);
+    int i;
+    for (i = 0; i < shell->num_finished; i++) {
+        if (shell->finished[i].line == (unsigned int)line_number && shell->finished[i].text == text &&
+                shell->finished[i].status == 0) {
+            break;
+        }
+    }
+    if (i == shell->num_finished) {
+        return 0;
+    }
+    char* input_cpy = strdup(input);
+    char** arr = parse_cmds(input_cpy);
+    int done = 1;
+    int j;
+    for (j = 0; arr[j] != NULL && done; j++) {
+        char** tokens = parse_input(arr[j]);
+        if (tokens[0] != NULL && check_command(tokens) == 1) {
+            done = 0;
+        }
+        free(tokens);
+    }
+    free(arr);
+    free(input_cpy);
+    return done;
+}
+
+/*
+ *  Function:  journal_record
+ *  --------------------
+ *  appends the record of a finished line to the journal. the write goes to the
+ *  page cache, so it survives dash being killed. fdatasync (which survives a crash
+ *  of the machine) is only done once per group of records, see sync_journal
+ * 
+ *  input: char pointer to the input line as it was before it ran
+ *  line_number: number of the line in the batch file
+ *  status: status returned by process
+ *  duration: nanoseconds the line took
+ */
+void journal_record(char* input, int line_number, int status, long duration) {
+    if (shell->journal_fd == -1 || check_empty_input(input) == 1) {
+        return;
+    }
+    struct journal_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.line = line_number;
+    entry.status = status;
+    entry.text = hash_line(input);
+    entry.duration = duration;
+    if (write(shell->journal_fd, &entry, sizeof(entry)) != sizeof(entry)) {
+        write_error();
+        return;
+    }
+    shell->unsynced++;
+    if (shell->unsynced >= JOURNAL_SYNC_RECORDS || now_ns() - shell->last_sync >= JOURNAL_SYNC_NS) {
+        sync_journal();
+    }
+}
+
+/*
+ *  Function:  sync_journal
+ *  --------------------
+ *  makes the records written so far durable
+ */
+void sync_journal() {
+    if (shell->journal_fd != -1 && shell->unsynced > 0 && getpid() == shell_pid) {
+        fdatasync(shell->journal_fd);
+        shell->unsynced = 0;
+        shell->last_sync = now_ns();
+    }
+}
+
+/*
+ *  Function:  dash_dir
+ *  --------------------
+ *  finds the directory dash keeps its files in ($HOME/.cache/dash) and creates it if needed
+ * 
+ *  returns: path of the directory
+ */
+char* dash_dir() {
+    static char dir[PATH_MAX];
+    if (dir[0] == '\0') {
+        char* home = getenv("HOME");
+        snprintf(dir, sizeof(dir), "%s/.cache", home != NULL ? home : "/tmp");
+        mkdir(dir, S_IRWXU);
+        strcat(dir, "/dash");
+        mkdir(dir, S_IRWXU);
+    }
+    return dir;
+}
+
+/*
+ *  Function:  open_history
+ *  --------------------
+ *  maps the duration history file (--history, or history in dash_dir) into memory.
+ *  a missing or damaged file starts an empty history. if it cannot be mapped,
+ *  commands start in the order they were written
+ */
+void open_history() {
+    char file[PATH_MAX + sizeof("/history")];
+    if (shell->opt.history_file != NULL) {
+        snprintf(file, sizeof(file), "%s", shell->opt.history_file);
+    }
+    else {
+        snprintf(file, sizeof(file), "%s/history", dash_dir());
+    }
+    int fd = open(file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size != sizeof(struct history_file) &&
+            ftruncate(fd, sizeof(struct history_file)) == -1)) {
+        close(fd);
+        return;
+    }
+    void* map = mmap(NULL, sizeof(struct history_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps the file open
+    if (map == MAP_FAILED) {
+        return;
+    }
+    shell->history = map;
+    if (memcmp(shell->history->magic, "DASHHIS1", 8) != 0) {
+        memset(shell->history, 0, sizeof(struct history_file));
+        memcpy(shell->history->magic, "DASHHIS1", 8);
+    }
+}
+
+/*
+ *  Function:  history_find
+ *  --------------------
+ *  finds the slot of a command in the duration history. the table is open addressed:
+ *  the slots after the key's home slot are searched. when creating and every
+ *  searched slot is taken, the home slot is reused. a new or reused slot starts empty
+ * 
+ *  key: signature of the command
+ *  create: 1 to take a free slot if the key is not found
+ * 
+ *  returns: the slot, or NULL if it is not found (or there is no history)
+ */
+struct history_slot* history_find(unsigned long key, int create) {
+    if (shell->history == NULL) {
+        return NULL;
+    }
+    int home = key % HISTORY_SLOTS;
+    int i;
+    for (i = 0; i < HISTORY_PROBES; i++) {
+        struct history_slot* slot = &shell->history->slots[(home + i) % HISTORY_SLOTS];
+        if (slot->key == key) {
+            return slot;
+        }
+        if (slot->key == 0) {
+            break;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    struct history_slot* slot = &shell->history->slots[(home + (i % HISTORY_PROBES)) % HISTORY_SLOTS];
+    memset(slot, 0, sizeof(struct history_slot));
+    slot->key = key;
+    return slot;
+}
+
+/*
+ *  Function:  job_signature
+ *  --------------------
+ *  computes the signature of a command for the duration history: its tokens
+ *  without the redirection target
+ * 
+ *  job: the job of the command
+ * 
+ *  returns: the signature (never 0)
+ */
+unsigned long job_signature(struct job* job) {
+    unsigned long hash = 14695981039346656037UL;
+    int len = count_tokens(job->argv) - (job->redirection == 1 ? 1 : 0);
+    int i;
+    for (i = 0; i < len; i++) {
+        hash = hash_string(hash, job->argv[i]);
+    }
+    return hash != 0 ? hash : 1;
+}
+
+/*
+ *  Function:  history_predict
+ *  --------------------
+ *  looks up how long a command took on average
+ * 
+ *  job: the job of the command
+ * 
+ *  returns: the predicted run time in nanoseconds, -1 if the command is unknown
+ */
+long history_predict(struct job* job) {
+    struct history_slot* slot = history_find(job_signature(job), 0);
+    if (slot == NULL || slot->runs == 0) {
+        return -1;
+    }
+    return slot->duration;
+}
+
+/*
+ *  Function:  history_predict_rss
+ *  --------------------
+ *  looks up the peak memory of a command
+ * 
+ *  job: the job of the command
+ * 
+ *  returns: the predicted peak resident set size in kilobytes, -1 if it is unknown
+ */
+long history_predict_rss(struct job* job) {
+    struct history_slot* slot = history_find(job_signature(job), 0);
+    if (slot == NULL || slot->max_rss == 0) {
+        return -1;
+    }
+    return slot->max_rss;
+}
+
+/*
+ *  Function:  fits_budget
+ *  --------------------
+ *  checks if a command may start under --mem-budget: its predicted peak memory and
+ *  that of the running commands of the line must fit in the budget. a command with no
+ *  history counts as 0, and a command starts anyway when nothing is running, so a
+ *  command bigger than the budget still runs (alone)
+ * 
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ *  job: the job that would start
+ * 
+ *  returns: 1 if the command may start, 0 if it has to wait
+ */
+int fits_budget(struct job jobs[], int num_jobs, struct job* job) {
+    if (shell->opt.mem_budget == 0 || shell->running_jobs == 0 || job->predicted_rss <= 0) {
+        return 1;
+    }
+    long used = 0;
+    int k;
+    for (k = 0; k < num_jobs; k++) {
+        if (jobs[k].state == JOB_RUNNING && jobs[k].predicted_rss > 0) {
+            used += jobs[k].predicted_rss;
+        }
+    }
+    return used + job->predicted_rss <= shell->opt.mem_budget;
+}
+
+/*
+ *  Function:  history_record
+ *  --------------------
+ *  adds a run time to the duration history. the average weighs recent runs more
+ *  (each new run counts for a quarter), so it follows commands that get slower.
+ *  the peak memory is the decayed average or the last peak, whichever is larger,
+ *  so a command is not packed as if it were smaller than it just was
+ * 
+ *  job: the job of the command
+ *  duration: run time in nanoseconds
+ */
+void history_record(struct job* job, long duration) {
+    struct history_slot* slot = history_find(job_signature(job), 1);
+    if (slot == NULL) {
+        return;
+    }
+    if (slot->runs == 0) {
+        slot->duration = duration;
+    }
+    else {
+        slot->duration = (slot->duration * 3 + duration) / 4;
+    }
+    if (job->max_rss > 0) {
+        long rss = (slot->max_rss * 3L + job->max_rss) / 4;
+        slot->max_rss = rss > job->max_rss ? rss : job->max_rss;
+    }
+    slot->runs++;
+}
+
+/*
+ *  Function:  report_open_pipe
+ *  --------------------
+ *  creates the pipe the children of a line write the time they call execv to.
+ *  the write end does not block, so a child never waits for the shell (a time
+ *  that does not fit in the pipe is lost and the exec time is reported as unknown)
+ */
+void report_open_pipe() {
+    if (shell->report_fds[0] == -1) {
+        if (pipe2(shell->report_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+            shell->report_fds[0] = -1;
+            shell->report_fds[1] = -1;
+        }
+    }
+}
+
+/*
+ *  Function:  report_exec
+ *  --------------------
+ *  called in the child just before execv to send its pid and the time to the shell
+ */
+void report_exec() {
+    if (shell->report_fds[1] == -1) {
+        return;
+    }
+    long record[2] = {getpid(), now_ns()};
+    // a write of less than PIPE_BUF bytes is never mixed with other children's writes
+    if (write(shell->report_fds[1], record, sizeof(record)) != sizeof(record)) {
+        return;
+    }
+}
+
+/*
+ *  Function:  report_add
+ *  --------------------
+ *  records the timing of a line whose commands have all been waited for
+ * 
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ *  line_start: time the line was parsed
+ */
+void report_add(struct job jobs[], int num_jobs, long line_start) {
+    long record[2];
+    // match the exec times sent by the children to their jobs
+    while (read(shell->report_fds[0], record, sizeof(record)) == sizeof(record)) {
+        int k;
+        for (k = 0; k < num_jobs; k++) {
+            if (jobs[k].pid == record[0] && jobs[k].start > 0) {
+                jobs[k].execed = record[1];
+            }
+        }
+    }
+
+    shell->report_lines = realloc(shell->report_lines, (shell->num_report_lines + 1) * sizeof(struct report_line));
+    struct report_line* line = &shell->report_lines[shell->num_report_lines];
+    shell->num_report_lines++;
+    line->line = shell->current_line;
+    shell->num_report_groups++;
+    line->group = shell->num_report_groups;
+    line->wall_ns = now_ns() - line_start;
+    line->num_jobs = 0;
+    line->jobs = malloc(num_jobs * sizeof(struct report_job));
+    int k;
+    for (k = 0; k < num_jobs; k++) {
+        struct job* job = &jobs[k];
+        // built-in commands, cache hits and duplicates did not run
+        if (job->start == 0 || job->end == 0) {
+            continue;
+        }
+        struct report_job* r = &line->jobs[line->num_jobs];
+        line->num_jobs++;
+        r->command = job_command(job);
+        long execed = job->execed > 0 ? job->execed : job->forked;
+        r->fork_ns = job->forked - job->start;
+        r->exec_ns = job->execed > 0 ? job->execed - job->start : -1;
+        r->run_ns = job->end - execed;
+        r->wait_ns = job->start - job->queued;
+        r->user_us = job->user_us;
+        r->system_us = job->system_us;
+        r->max_rss = job->max_rss;
+        r->status = job->status;
+    }
+}
+
+/*
+ *  Function:  job_command
+ *  --------------------
+ *  joins the tokens of a job back into a command, for --report and --machine
+ * 
+ *  job: the job
+ * 
+ *  returns: the command (malloced), with " > " before the redirection target
+ */
+char* job_command(struct job* job) {
+    int len = 3;
+    int t;
+    for (t = 0; job->argv[t] != NULL; t++) {
+        len += strlen(job->argv[t]) + 1;
+    }
+    char* command = malloc(len);
+    command[0] = '\0';
+    for (t = 0; job->argv[t] != NULL; t++) {
+        // the last token is the redirection target
+        if (t > 0) {
+            strcat(command, job->redirection == 1 && job->argv[t + 1] == NULL ? " > " : " ");
+        }
+        strcat(command, job->argv[t]);
+    }
+    return command;
+}
+
+/*
+ *  Function:  report_add_line
+ *  --------------------
+ *  records the timing of a line that ran in a child copy of the shell
+ *  (--auto-parallel), where only the time of the whole line is known
+ * 
+ *  input: char pointer to the input line
+ *  line_number: number of the line in the batch file
+ *  group: number shared by the lines of the group (see num_report_groups)
+ *  wall: nanoseconds the line took
+ *  status: status of the line
+ */
+void report_add_line(char* input, int line_number, int group, long wall, int status) {
+    shell->report_lines = realloc(shell->report_lines, (shell->num_report_lines + 1) * sizeof(struct report_line));
+    struct report_line* line = &shell->report_lines[shell->num_report_lines];
+    shell->num_report_lines++;
+    line->line = line_number;
+    line->group = group;
+    line->wall_ns = wall;
+    line->num_jobs = 1;
+    line->jobs = malloc(sizeof(struct report_job));
+    struct report_job* r = &line->jobs[0];
+    r->command = strndup(input, strcspn(input, "\n"));
+    r->fork_ns = -1;
+    r->exec_ns = -1;
+    r->run_ns = wall;
+    r->wait_ns = 0;
+    r->user_us = 0;
+    r->system_us = 0;
+    r->max_rss = 0;
+    r->status = status;
+}
+
+/*
+ *  Function:  print_report
+ *  --------------------
+ *  prints the --report to standard error when dash exits: the fork, exec, run and
+ *  wait time of every command, the critical path (the lines run one after the other,
+ *  so it is the longest command of each line) and the parallel efficiency, which is
+ *  the time spent running commands divided by the wall time times the number of
+ *  slots (--jobs, or the number of CPUs)
+ */
+void print_report() {
+    if (getpid() != shell_pid) {
+        return;
+    }
+    long wall = now_ns() - shell->report_start;
+    long slots = shell->opt.max_jobs > 0 ? shell->opt.max_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    long job_time = 0;
+    FILE* out = stderr;
+    fprintf(out, "\n%-5s %-5s %10s %10s %10s %10s %10s %10s %10s  %s\n", "line", "job", "fork_us",
+            "exec_us", "run_ms", "wait_ms", "user_ms", "sys_ms", "maxrss_kb", "command");
+    int i, k;
+    for (i = 0; i < shell->num_report_lines; i++) {
+        struct report_line* line = &shell->report_lines[i];
+        for (k = 0; k < line->num_jobs; k++) {
+            struct report_job* r = &line->jobs[k];
+            job_time += r->run_ns;
+            // unknown times are printed as -
+            char fork_us[32] = "-";
+            char exec_us[32] = "-";
+            if (r->fork_ns >= 0) {
+                snprintf(fork_us, sizeof(fork_us), "%.1f", r->fork_ns / 1e3);
+            }
+            if (r->exec_ns >= 0) {
+                snprintf(exec_us, sizeof(exec_us), "%.1f", r->exec_ns / 1e3);
+            }
+            fprintf(out, "%-5d %-5d %10s %10s %10.3f %10.3f %10.3f %10.3f %10ld  %s\n", line->line, k + 1,
+                    fork_us, exec_us, r->run_ns / 1e6, r->wait_ns / 1e6,
+                    r->user_us / 1e3, r->system_us / 1e3, r->max_rss, r->command);
+        }
+    }
+
+    // groups run one after the other, so the critical path is the longest line of each
+    // group and the command of that line that finished last
+    long critical = 0;
+    fprintf(out, "\ncritical path:\n");
+    for (i = 0; i < shell->num_report_lines; i = k) {
+        int longest = i;
+        for (k = i; k < shell->num_report_lines && shell->report_lines[k].group == shell->report_lines[i].group; k++) {
+            if (shell->report_lines[k].wall_ns > shell->report_lines[longest].wall_ns) {
+                longest = k;
+            }
+        }
+        struct report_line* line = &shell->report_lines[longest];
+        int last = -1;
+        int j;
+        for (j = 0; j < line->num_jobs; j++) {
+            if (last == -1 || line->jobs[j].wait_ns + line->jobs[j].run_ns >
+                    line->jobs[last].wait_ns + line->jobs[last].run_ns) {
+                last = j;
+            }
+        }
+        critical += line->wall_ns;
+        fprintf(out, "  line %-5d %10.3f ms  %s\n", line->line, line->wall_ns / 1e6,
+                last >= 0 ? line->jobs[last].command : "(built-in)");
+    }
+    fprintf(out, "  total %14.3f ms\n", critical / 1e6);
+    fprintf(out, "\nwall time %.3f ms, job time %.3f ms, %ld slots, parallel efficiency %.2f\n",
+            wall / 1e6, job_time / 1e6, slots, wall > 0 ? (double) job_time / ((double) wall * slots) : 0.0);
+}
+
+/*
+ *  Function:  parse_cpu_list
+ *  --------------------
+ *  parses a list of CPUs and CPU ranges separated by commas (ex. 0-3,8,10-11)
+ * 
+ *  list: the list as written
+ *  set: receives the CPUs
+ * 
+ *  returns: 0 if the list is valid and not empty, -1 otherwise
+ */
+int parse_cpu_list(char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    char* p = list;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        long cpu;
+        for (cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        }
+        else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/*
+ *  Function:  init_cpu_order
+ *  --------------------
+ *  sorts the CPUs the shell may run on (or the --cpu-policy list) into the order
+ *  commands are placed on them. spread takes the first hyperthread of every core,
+ *  alternating packages, before any second hyperthread. compact fills a core, then
+ *  the next core of the same package. a list is used as written
+ */
+void init_cpu_order() {
+    cpu_set_t set;
+    if (shell->opt.cpu_policy == CPU_LIST) {
+        parse_cpu_list(shell->opt.cpu_list, &set);
+    }
+    else if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        CPU_ZERO(&set);
+        CPU_SET(0, &set);
+    }
+    free(shell->cpu_order);
+    shell->num_cpu_order = 0;
+    shell->cpu_order = malloc(CPU_COUNT(&set) * sizeof(int));
+    struct cpu_info cpus[CPU_COUNT(&set)];
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) {
+            continue;
+        }
+        struct cpu_info* info = &cpus[shell->num_cpu_order];
+        info->cpu = cpu;
+        info->package = 0;
+        info->core = cpu;
+        // missing topology files leave every CPU on its own core
+        char name[PATH_MAX];
+        FILE* file;
+        snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        if ((file = fopen(name, "r")) != NULL) {
+            if (fscanf(file, "%d", &info->package) != 1) {
+                info->package = 0;
+            }
+            fclose(file);
+        }
+        snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        if ((file = fopen(name, "r")) != NULL) {
+            if (fscanf(file, "%d", &info->core) != 1) {
+                info->core = cpu;
+            }
+            fclose(file);
+        }
+        // hyperthreads of a core are numbered in CPU order
+        info->thread = 0;
+        int k;
+        for (k = 0; k < shell->num_cpu_order; k++) {
+            if (cpus[k].package == info->package && cpus[k].core == info->core) {
+                info->thread++;
+            }
+        }
+        shell->num_cpu_order++;
+    }
+    if (shell->opt.cpu_policy == CPU_SPREAD) {
+        qsort(cpus, shell->num_cpu_order, sizeof(struct cpu_info), compare_spread);
+    }
+    else if (shell->opt.cpu_policy == CPU_COMPACT) {
+        qsort(cpus, shell->num_cpu_order, sizeof(struct cpu_info), compare_compact);
+    }
+    int k;
+    for (k = 0; k < shell->num_cpu_order; k++) {
+        shell->cpu_order[k] = cpus[k].cpu;
+    }
+}
+
+/*
+ *  Function:  compare_spread
+ *  --------------------
+ *  orders CPUs by hyperthread, then core, then package
+ * 
+ *  a: pointer to a struct cpu_info
+ *  b: pointer to a struct cpu_info
+ * 
+ *  returns: negative if a comes first, positive if b comes first
+ */
+int compare_spread(const void* a, const void* b) {
+    const struct cpu_info* x = a;
+    const struct cpu_info* y = b;
+    if (x->thread != y->thread) {
+        return x->thread - y->thread;
+    }
+    if (x->core != y->core) {
+        return x->core - y->core;
+    }
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    return x->cpu - y->cpu;
+}
+
+/*
+ *  Function:  compare_compact
+ *  --------------------
+ *  orders CPUs by package, then core, then hyperthread
+ * 
+ *  a: pointer to a struct cpu_info
+ *  b: pointer to a struct cpu_info
+ * 
+ *  returns: negative if a comes first, positive if b comes first
+ */
+int compare_compact(const void* a, const void* b) {
+    const struct cpu_info* x = a;
+    const struct cpu_info* y = b;
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    if (x->core != y->core) {
+        return x->core - y->core;
+    }
+    if (x->thread != y->thread) {
+        return x->thread - y->thread;
+    }
+    return x->cpu - y->cpu;
+}
+
+/*
+ *  Function:  assign_cpu
+ *  --------------------
+ *  places a command that is about to start on the first CPU in cpu_order that the
+ *  fewest running commands of the line use, so the CPUs of finished commands are
+ *  reused. commands with an affinity prefix keep their CPUs
+ * 
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ *  k: index of the job that is about to start
+ */
+void assign_cpu(struct job jobs[], int num_jobs, int k) {
+    if (jobs[k].has_cpus) {
+        return;
+    }
+    if (shell->cpu_order == NULL) {
+        init_cpu_order();
+    }
+    int used[shell->num_cpu_order];
+    memset(used, 0, sizeof(used));
+    int j;
+    for (j = 0; j < num_jobs; j++) {
+        if (jobs[j].state == JOB_RUNNING && jobs[j].cpu >= 0) {
+            used[jobs[j].cpu]++;
+        }
+    }
+    int best = 0;
+    for (j = 1; j < shell->num_cpu_order; j++) {
+        if (used[j] < used[best]) {
+            best = j;
+        }
+    }
+    jobs[k].cpu = best;
+    jobs[k].has_cpus = 1;
+    CPU_ZERO(&jobs[k].cpus);
+    CPU_SET(shell->cpu_order[best], &jobs[k].cpus);
+}
+
+/*
+ *  Function:  dash_affinity
+ *  --------------------
+ *  built-in implementation of affinity. with no arguments it prints the CPUs the
+ *  shell runs on, and with a CPU list it moves the shell (and so every command
+ *  started without a placement) onto those CPUs
+ * 
+ *  arrTok: char** that has been tokenized
+ */
+void dash_affinity(char** arrTok) {
+    cpu_set_t set;
+    int args = count_tokens(arrTok) - 1;
+    if (args == 1) {
+        if (parse_cpu_list(arrTok[1], &set) == -1 || sched_setaffinity(0, sizeof(set), &set) == -1) {
+            write_error();
+        }
+        // --cpu-policy hands out the new CPUs from now on
+        else if (shell->opt.cpu_policy != CPU_LIST && shell->cpu_order != NULL) {
+            init_cpu_order();
+        }
+        return;
+    }
+    if (args != 0 || sched_getaffinity(0, sizeof(set), &set) == -1) {
+        write_error();
+        return;
+    }
+    // print the CPUs as ranges (ex. 0-3,8)
+    int cpu = 0;
+    int first = 1;
+    while (cpu < CPU_SETSIZE) {
+        if (!CPU_ISSET(cpu, &set)) {
+            cpu++;
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) {
+            last++;
+        }
+        printf(first ? "%d" : ",%d", cpu);
+        if (last > cpu) {
+            printf("-%d", last);
+        }
+        first = 0;
+        cpu = last + 1;
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/*
+ *  Function:  parse_limit
+ *  --------------------
+ *  parses a resource limit written as name=value, where value is a number, a size
+ *  for mem and fsize (ex. 512M), or unlimited
+ * 
+ *  setting: the limit as written
+ *  index: receives the index of the limit in limit_names
+ *  value: receives the limit
+ * 
+ *  returns: 0 if the limit is valid, -1 otherwise
+ */
+int parse_limit(char* setting, int* index, rlim_t* value) {
+    char* equals = strchr(setting, '=');
+    if (equals == NULL) {
+        return -1;
+    }
+    int l;
+    for (l = 0; l < NUM_LIMITS; l++) {
+        if (strncmp(setting, limit_names[l].name, equals - setting) == 0 &&
+                limit_names[l].name[equals - setting] == '\0') {
+            break;
+        }
+    }
+    if (l == NUM_LIMITS) {
+        return -1;
+    }
+    *index = l;
+    if (strcmp(equals + 1, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    long number;
+    if (limit_names[l].is_size) {
+        number = parse_size(equals + 1);
+    }
+    else {
+        char* end;
+        number = strtol(equals + 1, &end, 10);
+        if (end == equals + 1 || *end != '\0') {
+            number = -1;
+        }
+    }
+    if (number < 0) {
+        return -1;
+    }
+    *value = number;
+    return 0;
+}
+
+/*
+ *  Function:  dash_ulimit
+ *  --------------------
+ *  built-in implementation of ulimit. with no arguments it prints the limits of the
+ *  shell, and with name=value arguments it sets them for the shell and every command
+ *  started after it. only the soft limit is changed, so a limit can be raised again
+ *  up to the hard limit
+ * 
+ *  arrTok: char** that has been tokenized
+ */
+void dash_ulimit(char** arrTok) {
+    struct rlimit limit;
+    int l;
+    if (arrTok[1] == NULL) {
+        for (l = 0; l < NUM_LIMITS; l++) {
+            getrlimit(limit_names[l].resource, &limit);
+            if (limit.rlim_cur == RLIM_INFINITY) {
+                printf("%s unlimited\n", limit_names[l].name);
+            }
+            else {
+                printf("%s %lu\n", limit_names[l].name, (unsigned long) limit.rlim_cur);
+            }
+        }
+        fflush(stdout);
+        return;
+    }
+    int i;
+    for (i = 1; arrTok[i] != NULL; i++) {
+        rlim_t value;
+        if (parse_limit(arrTok[i], &l, &value) == -1 || getrlimit(limit_names[l].resource, &limit) == -1) {
+            write_error();
+            continue;
+        }
+        limit.rlim_cur = value;
+        if (setrlimit(limit_names[l].resource, &limit) == -1) {
+            write_error();
+        }
+    }
+}
+
+/*
+ *  Function:  expand_vars
+ *  --------------------
+ *  replaces tokens naming a result of the last line with its value:
+ *  $? (status), $UTIME and $STIME (user and system CPU time in milliseconds, summed
+ *  over the commands of the line) and $MAXRSS (largest peak memory of a command in
+ *  kilobytes). other tokens are left as they are
+ * 
+ *  ctx: the shell that ran the last line
+ *  arrTok: char** that has been tokenized
+ */
+void expand_vars(struct dash_ctx* ctx, char** arrTok) {
+    snprintf(ctx->var_status, sizeof(ctx->var_status), "%d", ctx->last_status);
+    snprintf(ctx->var_utime, sizeof(ctx->var_utime), "%ld", ctx->last_user_us / 1000);
+    snprintf(ctx->var_stime, sizeof(ctx->var_stime), "%ld", ctx->last_system_us / 1000);
+    snprintf(ctx->var_maxrss, sizeof(ctx->var_maxrss), "%ld", ctx->last_max_rss);
+    int i;
+    for (i = 0; arrTok[i] != NULL; i++) {
+        if (strcmp(arrTok[i], "$?") == 0) {
+            arrTok[i] = ctx->var_status;
+        }
+        else if (strcmp(arrTok[i], "$UTIME") == 0) {
+            arrTok[i] = ctx->var_utime;
+        }
+        else if (strcmp(arrTok[i], "$STIME") == 0) {
+            arrTok[i] = ctx->var_stime;
+        }
+        else if (strcmp(arrTok[i], "$MAXRSS") == 0) {
+            arrTok[i] = ctx->var_maxrss;
+        }
+    }
+}
+
+/*
+ *  Function:  job_limit
+ *  --------------------
+ *  gets the most commands (or --auto-parallel lines) that may run at once. with
+ *  --jobs=auto the limit starts at the number of CPUs and is moved by an additive
+ *  increase, multiplicative decrease controller fed by sample_pressure, so dash backs
+ *  off before the machine runs out of memory and uses CPUs that other programs leave idle
+ * 
+ *  returns: the limit, 0 for no limit
+ */
+int job_limit() {
+    if (!shell->opt.adaptive) {
+        return shell->opt.max_jobs;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (shell->pressure.limit == 0) {
+        shell->pressure.limit = cpus > 0 ? cpus : 1;
+    }
+    // cached values are used until the refresh interval has passed
+    if (now_ns() - shell->pressure.sampled < PRESSURE_REFRESH_NS) {
+        return shell->pressure.limit;
+    }
+    int first = shell->pressure.sampled == 0;
+    sample_pressure();
+    if (first) {
+        return shell->pressure.limit;
+    }
+    int short_of_memory = shell->pressure.mem_some > PRESSURE_MEM_HIGH ||
+        (shell->pressure.memory_kb > 0 && shell->pressure.available_kb * 100 < shell->pressure.memory_kb * PRESSURE_MEM_FREE);
+    if (short_of_memory || shell->pressure.cpu_some > PRESSURE_CPU_HIGH) {
+        shell->pressure.limit = shell->pressure.limit > 1 ? shell->pressure.limit / 2 : 1;
+    }
+    // only grow a limit that is holding commands back, up to 4 per CPU
+    else if (shell->pressure.cpu_some < PRESSURE_CPU_LOW && shell->pressure.held_back && shell->pressure.limit < 4 * cpus) {
+        shell->pressure.limit++;
+    }
+    shell->pressure.held_back = 0;
+    return shell->pressure.limit;
+}
+
+/*
+ *  Function:  sample_pressure
+ *  --------------------
+ *  reads CPU and memory stall time (pressure stall information) and available memory.
+ *  the stall percentages are over the time since the previous sample. a missing
+ *  file (older kernels) counts as no stalls
+ */
+void sample_pressure() {
+    long now = now_ns();
+    long cpu_total = read_stall("/proc/pressure/cpu");
+    long mem_total = read_stall("/proc/pressure/memory");
+    if (shell->pressure.sampled != 0) {
+        double interval_us = (now - shell->pressure.sampled) / 1e3;
+        shell->pressure.cpu_some = (cpu_total - shell->pressure.cpu_total) * 100 / interval_us;
+        shell->pressure.mem_some = (mem_total - shell->pressure.mem_total) * 100 / interval_us;
+    }
+    shell->pressure.cpu_total = cpu_total;
+    shell->pressure.mem_total = mem_total;
+    shell->pressure.sampled = now;
+
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (file == NULL) {
+        return;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        sscanf(line, "MemTotal: %ld", &shell->pressure.memory_kb);
+        sscanf(line, "MemAvailable: %ld", &shell->pressure.available_kb);
+    }
+    fclose(file);
+}
+
+/*
+ *  Function:  read_stall
+ *  --------------------
+ *  reads the total of the "some" line of a pressure file
+ * 
+ *  file: path of the pressure file
+ * 
+ *  returns: microseconds some task has stalled since boot, 0 if the file cannot be read
+ */
+long read_stall(char* file) {
+    long total = 0;
+    FILE* pressure_file = fopen(file, "r");
+    if (pressure_file == NULL) {
+        return 0;
+    }
+    if (fscanf(pressure_file, "some avg10=%*f avg60=%*f avg300=%*f total=%ld", &total) != 1) {
+        total = 0;
+    }
+    fclose(pressure_file);
+    return total;
+}
+
+/*
+ *  Function:  parse_ioprio
+ *  --------------------
+ *  parses an I/O priority class for the ionice prefix: idle, best-effort or realtime,
+ *  optionally followed by a level from 0 (highest) to 7 (ex. best-effort:7)
+ * 
+ *  value: the class as written
+ *  ioprio: receives the priority in the form ioprio_set takes
+ * 
+ *  returns: 0 if the class is valid, -1 otherwise
+ */
+int parse_ioprio(char* value, int* ioprio) {
+    int level = 4;      // the level of best-effort processes with niceness 0
+    char* colon = strchr(value, ':');
+    int len = colon != NULL ? (int)(colon - value) : (int)strlen(value);
+    int class;
+    if (strncmp(value, "idle", len) == 0 && len == 4) {
+        class = IOPRIO_CLASS_IDLE;
+        level = 0;
+    }
+    else if (strncmp(value, "best-effort", len) == 0 && len == 11) {
+        class = IOPRIO_CLASS_BE;
+    }
+    else if (strncmp(value, "realtime", len) == 0 && len == 8) {
+        class = IOPRIO_CLASS_RT;
+    }
+    else {
+        return -1;
+    }
+    if (colon != NULL) {
+        if (class == IOPRIO_CLASS_IDLE || colon[1] < '0' || colon[1] > '7' || colon[2] != '\0') {
+            return -1;
+        }
+        level = colon[1] - '0';
+    }
+    *ioprio = class << IOPRIO_CLASS_SHIFT | level;
+    return 0;
+}
+
+/*
+ *  Function:  sem_acquire
+ *  --------------------
+ *  takes a slot of a named counting semaphore shared by every dash on the machine.
+ *  the semaphore is a file in /dev/shm (or ~/.cache/dash) with 1 byte per slot after
+ *  a first byte for the waiters, and a slot is held by a write lock on its byte. the
+ *  lock belongs to the process and stays through execv, and the kernel releases it
+ *  when the process exits for any reason, so a holder that is killed never leaks its
+ *  slot. when every slot is held, the waiters queue on the first byte and the one
+ *  holding it tries all the slots until one is free, so any slot that is released is
+ *  used. called in the child
+ * 
+ *  name: name of the semaphore
+ *  slots: number of slots, the most holders at once
+ * 
+ *  returns: 0 once a slot is held, -1 if the semaphore file cannot be used
+ */
+int sem_acquire(char* name, int slots) {
+    char file[PATH_MAX];
+    sem_file(name, file, sizeof(file));
+    int fd = open(file, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 1;
+    long delay = 1000000L;
+    int waiting = 0;    // 1 once the lock on the waiters byte is held
+    while (1) {
+        // a free slot is taken right away
+        int slot;
+        for (slot = 1; slot <= slots; slot++) {
+            lock.l_type = F_WRLCK;
+            lock.l_start = slot;
+            if (fcntl(fd, F_SETLK, &lock) == 0) {
+                // let the next waiter try
+                if (waiting) {
+                    lock.l_type = F_UNLCK;
+                    lock.l_start = 0;
+                    fcntl(fd, F_SETLK, &lock);
+                }
+                return 0;
+            }
+            if (errno != EACCES && errno != EAGAIN) {
+                close(fd);
+                return -1;
+            }
+        }
+        // otherwise wait for the other waiters first
+        if (!waiting) {
+            lock.l_start = 0;
+            while (fcntl(fd, F_SETLKW, &lock) == -1) {
+                if (errno != EINTR) {
+                    close(fd);
+                    return -1;
+                }
+            }
+            waiting = 1;
+            continue;
+        }
+        // then check often at first, then every 50 ms
+        struct timespec wait = {0, delay};
+        nanosleep(&wait, NULL);
+        delay = delay * 2 < 50000000L ? delay * 2 : 50000000L;
+    }
+}
+
+/*
+ *  Function:  sem_file
+ *  --------------------
+ *  gets the path of the file of a named semaphore (see sem_acquire)
+ * 
+ *  name: name of the semaphore
+ *  file: receives the path
+ *  size: size of file
+ */
+void sem_file(char* name, char* file, size_t size) {
+    struct stat st;
+    if (stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(file, size, "/dev/shm/dash-sem-%s", name);
+    }
+    else {
+        snprintf(file, size, "%s/sem-%s", dash_dir(), name);
+    }
+}
+
+/*
+ *  Function:  run_scripts
+ *  --------------------
+ *  runs several batch files at the same time (--parallel). each file runs in its own
+ *  copy of the shell, so the directory, path and variables of one file do not affect
+ *  the others. every line of output is prefixed with the name of the file, or with
+ *  --output-dir the output of a file goes to DIR/NAME.out. --jobs limits the commands
+ *  of all the files together through a semaphore (see sem_acquire), and --journal and
+ *  --incremental=FILE get .1, .2, ... appended for each file. exits the shell once
+ *  every file has finished
+ * 
+ *  files: names of the batch files
+ *  num_files: number of batch files
+ *  ctx: the shell
+ */
+void run_scripts(char* files[], int num_files, struct dash_ctx* ctx) {
+    char sem_name[32];
+    if (shell->opt.max_jobs > 0) {
+        snprintf(sem_name, sizeof(sem_name), "jobs-%d", getpid());
+        jobs_sem = sem_name;
+    }
+    pid_t pids[num_files];
+    int fds[2 * num_files];         // read ends of the standard output and error of each file, -1 once closed
+    char* pending[2 * num_files];   // output after the last newline
+    size_t pending_len[2 * num_files];
+    fflush(stdout);
+    int k;
+    for (k = 0; k < num_files; k++) {
+        int out[2] = {-1, -1};
+        int err[2] = {-1, -1};
+        fds[2 * k] = -1;
+        fds[2 * k + 1] = -1;
+        pending[2 * k] = NULL;
+        pending[2 * k + 1] = NULL;
+        pending_len[2 * k] = 0;
+        pending_len[2 * k + 1] = 0;
+        if (shell->opt.output_dir == NULL && (pipe(out) == -1 || pipe(err) == -1)) {
+            write_error();
+            pids[k] = -1;
+            continue;
+        }
+        pids[k] = fork();
+        if (pids[k] == 0) {
+            char* name = strrchr(files[k], '/') != NULL ? strrchr(files[k], '/') + 1 : files[k];
+            if (shell->opt.output_dir != NULL) {
+                char file[PATH_MAX];
+                snprintf(file, sizeof(file), "%s/%s.out", shell->opt.output_dir, name);
+                int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd == -1) {
+                    write_error();
+                    _exit(1);
+                }
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+            else {
+                dup2(out[1], STDOUT_FILENO);
+                dup2(err[1], STDERR_FILENO);
+                int j;
+                for (j = 0; j < 2 * k; j++) {
+                    if (fds[j] != -1) {
+                        close(fds[j]);
+                    }
+                }
+                close(out[0]);
+                close(out[1]);
+                close(err[0]);
+                close(err[1]);
+            }
+            // files that keep state between runs get 1 per batch file
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), ".%d", k + 1);
+            if (shell->opt.journal != NULL) {
+                char* journal = malloc(strlen(shell->opt.journal) + strlen(suffix) + 1);
+                strcpy(journal, shell->opt.journal);
+                strcat(journal, suffix);
+                shell->opt.journal = journal;
+            }
+            if (shell->opt.index_file != NULL) {
+                char* index_file = malloc(strlen(shell->opt.index_file) + strlen(suffix) + 1);
+                strcpy(index_file, shell->opt.index_file);
+                strcat(index_file, suffix);
+                shell->opt.index_file = index_file;
+            }
+            shell_pid = getpid();
+            init_state(files[k]);
+            run_batch(files[k], ctx);
+            exit(1);
+        }
+        if (pids[k] < 0) {
+            write_error();
+        }
+        if (shell->opt.output_dir == NULL) {
+            close(out[1]);
+            close(err[1]);
+            if (pids[k] > 0) {
+                fds[2 * k] = out[0];
+                fds[2 * k + 1] = err[0];
+            }
+            else {
+                close(out[0]);
+                close(err[0]);
+            }
+        }
+    }
+
+    // copy whole lines as they come, so lines of different files are not mixed
+    struct pollfd polls[2 * num_files];
+    int open_fds = 0;
+    for (k = 0; k < 2 * num_files; k++) {
+        open_fds += fds[k] != -1;
+    }
+    while (open_fds > 0) {
+        for (k = 0; k < 2 * num_files; k++) {
+            polls[k].fd = fds[k];
+            polls[k].events = POLLIN;
+        }
+        if (poll(polls, 2 * num_files, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (k = 0; k < 2 * num_files; k++) {
+            if (fds[k] == -1 || polls[k].revents == 0) {
+                continue;
+            }
+            char* name = strrchr(files[k / 2], '/') != NULL ? strrchr(files[k / 2], '/') + 1 : files[k / 2];
+            int to = k % 2 == 0 ? STDOUT_FILENO : STDERR_FILENO;
+            char buf[BUF_SIZE * 4];
+            ssize_t n = read(fds[k], buf, sizeof(buf));
+            if (n > 0) {
+                pending[k] = realloc(pending[k], pending_len[k] + n);
+                memcpy(pending[k] + pending_len[k], buf, n);
+                pending_len[k] += n;
+                char* newline = memrchr(pending[k], '\n', pending_len[k]);
+                if (newline != NULL) {
+                    size_t done = newline - pending[k] + 1;
+                    write_prefixed(to, name, pending[k], done);
+                    memmove(pending[k], pending[k] + done, pending_len[k] - done);
+                    pending_len[k] -= done;
+                }
+                continue;
+            }
+            // end of the output, a last line without a newline gets one
+            if (pending_len[k] > 0) {
+                write_prefixed(to, name, pending[k], pending_len[k]);
+                write(to, "\n", 1);
+            }
+            free(pending[k]);
+            close(fds[k]);
+            fds[k] = -1;
+            open_fds--;
+        }
+    }
+
+    int failed = 0;
+    for (k = 0; k < num_files; k++) {
+        int status;
+        if (pids[k] < 0 || waitpid(pids[k], &status, 0) == -1 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    if (jobs_sem != NULL) {
+        char file[PATH_MAX];
+        sem_file(jobs_sem, file, sizeof(file));
+        unlink(file);
+    }
+    exit(failed);
+}
+
+/*
+ *  Function:  write_prefixed
+ *  --------------------
+ *  writes lines with a prefix in front of each one
+ * 
+ *  to: file descriptor to write to
+ *  prefix: the prefix, written as "prefix: "
+ *  data: the lines
+ *  len: number of bytes in data
+ */
+void write_prefixed(int to, char* prefix, char* data, size_t len) {
+    size_t start = 0;
+    while (start < len) {
+        char* newline = memchr(data + start, '\n', len - start);
+        size_t end = newline != NULL ? (size_t)(newline - data) + 1 : len;
+        write(to, prefix, strlen(prefix));
+        write(to, ": ", 2);
+        write(to, data + start, end - start);
+        start = end;
+    }
+}
+
+/*
+ *  Function:  join_group
+ *  --------------------
+ *  puts a command into the process group of its line. the first command of the line
+ *  starts the group. called in the child (pid 0) and in the shell (pid of the child),
+ *  so the group is set before either one goes on. if the group has ended because all
+ *  its commands have been waited for, the command starts a new one. in interactive
+ *  mode the group is given the terminal, so Ctrl-C reaches the commands
+ * 
+ *  pid: pid of the command, 0 for the calling process
+ */
+void join_group(pid_t pid) {
+    if (shell->line_pgid != 0 && setpgid(pid, shell->line_pgid) == 0) {
+        return;
+    }
+    // the child has already set its group and called execv
+    if (shell->line_pgid != 0 && pid != 0 && errno == EACCES) {
+        shell->line_pgid = getpgid(pid);
+        return;
+    }
+    setpgid(pid, 0);
+    shell->line_pgid = pid != 0 ? pid : getpid();
+    if (owns_terminal) {
+        tcsetpgrp(STDIN_FILENO, shell->line_pgid);
+    }
+}
+
+/*
+ *  Function:  forward_signal
+ *  --------------------
+ *  signal handler of the shell for SIGINT, SIGTERM and SIGHUP: sends the signal to
+ *  the process group of the commands of the line
+ * 
+ *  sig: the signal
+ */
+void forward_signal(int sig) {
+    backend->kill(sig);
+    interrupted = sig;
+}
+
+/*
+ *  Function:  init_signals
+ *  --------------------
+ *  installs forward_signal. when standard input is the terminal and the shell is in
+ *  the foreground, the commands of each line get the terminal (in batch mode too, so
+ *  a command reading the terminal is not stopped), and the shell ignores SIGTTOU so
+ *  it can take it back
+ * 
+ *  interactive: 1 in interactive mode
+ */
+void init_signals(int interactive) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = forward_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    interactive_shell = interactive;
+    if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp()) {
+        signal(SIGTTOU, SIG_IGN);
+        owns_terminal = 1;
+    }
+}
+
+/*
+ *  Function:  drain_jobs
+ *  --------------------
+ *  waits for the running commands of a line until a deadline, then kills the ones
+ *  that are left with 1 signal to their process group and waits for them
+ * 
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ *  deadline: time (see now_ns) to stop waiting
+ */
+void drain_jobs(struct job jobs[], int num_jobs, long deadline) {
+    long delay = 1000000L;
+    while (shell->running_jobs > 0 && now_ns() < deadline) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait_cmd(&status, &usage, WNOHANG);
+        if (pid == -1) {
+            break;
+        }
+        if (pid == 0) {
+            // check often at first, then every 50 ms
+            struct timespec wait = {0, delay};
+            nanosleep(&wait, NULL);
+            delay = delay * 2 < 50000000L ? delay * 2 : 50000000L;
+            continue;
+        }
+        int k;
+        for (k = 0; k < num_jobs; k++) {
+            if (jobs[k].state == JOB_RUNNING && jobs[k].pid == pid) {
+                finish_job(&jobs[k], status, &usage);
+            }
+        }
+    }
+    if (shell->running_jobs > 0) {
+        backend->kill(SIGKILL);
+    }
+    wait_for_cmds(jobs, num_jobs);
+}
+
+/*
+ *  Function:  start_spawn_server
+ *  --------------------
+ *  forks the --spawn-server helper while the shell is still small. the helper forks the
+ *  commands the shell sends it, so the time a start takes does not grow with the memory
+ *  of the shell. if the helper cannot be started, the shell forks the commands itself
+ */
+void start_spawn_server() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        write_error();
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        spawn_server(fds[1]);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        write_error();
+        close(fds[0]);
+        return;
+    }
+    spawn_fd = fds[0];
+    backend = &spawn_backend;
+}
+
+/*
+ *  Function:  spawn_server
+ *  --------------------
+ *  main loop of the --spawn-server helper. forks a command for every spawn_request and
+ *  answers with its pid, and waits for the commands it started and sends their status
+ *  to the shell, since the shell cannot wait for them. the helper does not use stdio
+ *  and leaves once the shell has closed the socket. does not return
+ * 
+ *  sock: the helper's end of the socket to the shell
+ */
+void spawn_server(int sock) {
+    // the paths come with the requests, the directories of the shell's would get stale
+    close_path_dirs(shell);
+    // the shell forwards signals to the commands (see forward_signal), the helper ignores them
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+    if (sfd == -1) {
+        _exit(1);
+    }
+    static char buf[SPAWN_MSG_MAX];
+    while (1) {
+        struct pollfd fds[2] = {{sock, POLLIN, 0}, {sfd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        // send the status of every command that has finished
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sfd, &info, sizeof(info)) != sizeof(info)) {
+                continue;
+            }
+            struct spawn_reply reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = SPAWN_EXITED;
+            while ((reply.pid = wait4(-1, &reply.status, WNOHANG, &reply.usage)) > 0) {
+                send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+            }
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP))) {
+            continue;
+        }
+        char control[CMSG_SPACE(SPAWN_FDS * sizeof(int))];
+        struct iovec iov = {buf, sizeof(buf)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        // the shell has exited
+        if (len == 0 || (len == -1 && errno != EINTR)) {
+            _exit(0);
+        }
+        if (len < (ssize_t)sizeof(struct spawn_request)) {
+            continue;
+        }
+        int received[SPAWN_FDS];
+        int num_received = 0;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            num_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(received, CMSG_DATA(cmsg), num_received * sizeof(int));
+        }
+        struct spawn_request* req = (struct spawn_request*)buf;
+        struct job job;
+        char* argv[req->num_args + 1];
+        char* path[req->num_path + 1];
+        unpack_request(req, &job, argv, path);
+        job.dir_fd = req->has_dir && num_received > 3 ? received[3] : -1;
+        shell->line_pgid = req->pgid;
+        owns_terminal = req->owns_terminal;
+
+        struct spawn_reply reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.type = SPAWN_STARTED;
+        reply.pid = -1;
+        reply.error = EINVAL;
+        int k;
+        if (num_received >= 3) {
+            reply.pid = fork();
+            reply.error = errno;
+        }
+        if (reply.pid == 0) {
+            // the command gets the standard input, output and error the shell has now
+            for (k = 0; k < 3; k++) {
+                dup2(received[k], k);
+            }
+            if (req->has_report) {
+                shell->report_fds[1] = received[num_received - 1];
+            }
+            sigprocmask(SIG_UNBLOCK, &chld, NULL);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGHUP, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            exec_child(&job, path, 1);
+        }
+        if (reply.pid > 0) {
+            join_group(reply.pid);
+        }
+        reply.pgid = shell->line_pgid;
+        for (k = 0; k < num_received; k++) {
+            close(received[k]);
+        }
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+
+/*
+ *  Function:  spawn_remote
+ *  --------------------
+ *  sends a job to the --spawn-server helper and waits for its answer. commands the
+ *  helper reports as finished in the meantime are kept for wait_cmd. if the helper has
+ *  gone away, spawn_fd is set to -1 so the shell forks the command itself
+ * 
+ *  job: the job of the command
+ *  path: the path the command is searched in
+ * 
+ *  returns: pid of the command, or -1 with errno set if the helper could not fork it
+ */
+pid_t spawn_remote(struct job* job, char** path) {
+    static char buf[SPAWN_MSG_MAX];
+    struct spawn_request* req = (struct spawn_request*)buf;
+    size_t len = pack_request(job, path, buf, sizeof(buf));
+    // too long for 1 message: fork here
+    if (len == 0) {
+        spawn_close();
+        return -1;
+    }
+
+    int fds[SPAWN_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int num_fds = 3;
+    if (req->has_dir) {
+        fds[num_fds++] = job->dir_fd;
+    }
+    if (req->has_report) {
+        fds[num_fds++] = shell->report_fds[1];
+    }
+    char control[CMSG_SPACE(SPAWN_FDS * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    // output written by the shell so far comes before the command's
+    fflush(stdout);
+    if (sendmsg(spawn_fd, &msg, MSG_NOSIGNAL) == -1) {
+        spawn_close();
+        return -1;
+    }
+
+    while (1) {
+        struct spawn_reply reply;
+        ssize_t n = recv(spawn_fd, &reply, sizeof(reply), 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        // the helper has gone away after taking the request, launch_jobs retries the start
+        if (n != sizeof(reply)) {
+            spawn_close();
+            errno = EAGAIN;
+            return -1;
+        }
+        if (reply.type == SPAWN_EXITED) {
+            add_exit(reply.pid, reply.status, &reply.usage);
+            continue;
+        }
+        if (reply.pid < 0) {
+            errno = reply.error;
+            if (errno != EAGAIN && errno != ENOMEM) {
+                write_error();
+            }
+            return -1;
+        }
+        // the shell takes the terminal back from the group with tcsetpgrp
+        shell->line_pgid = reply.pgid;
+        return reply.pid;
+    }
+}
+
+/*
+ *  Function:  wait_cmd
+ *  --------------------
+ *  waits for any command to finish, like wait4, with the backend that started it.
+ *  commands a backend reported finished earlier come first (see add_exit)
+ * 
+ *  status: set to the status of the command
+ *  usage: set to the resources used by the command
+ *  options: WNOHANG to return 0 at once if no command has finished, else 0 or WUNTRACED
+ * 
+ *  returns: pid of the command, 0 with WNOHANG if none has finished, -1 if there is
+ *           no command to wait for
+ */
+pid_t wait_cmd(int* status, struct rusage* usage, int options) {
+    if (num_spawn_exits > 0) {
+        struct spawn_reply reply = spawn_exits[0];
+        num_spawn_exits--;
+        memmove(spawn_exits, spawn_exits + 1, num_spawn_exits * sizeof(struct spawn_reply));
+        *status = reply.status;
+        *usage = reply.usage;
+        return reply.pid;
+    }
+    return backend->wait(status, usage, options);
+}
+
+/*
+ *  Function:  wait_local
+ *  --------------------
+ *  waits for a command forked by the shell, the wait of the local backend. only the
+ *  children in the shell's list are waited for, through their pidfds, so the other
+ *  children of a program using libdash, or of another shell in another thread, are
+ *  left to it. stopped commands are not reported
+ * 
+ *  status: set to the status of the command
+ *  usage: set to the resources used by the command
+ *  options: WNOHANG to return 0 at once if no command has finished
+ * 
+ *  returns: as wait4, -1 with ECHILD if the shell has no command running
+ */
+pid_t wait_local(int* status, struct rusage* usage, int options) {
+    while (shell->num_children > 0) {
+        struct pollfd fds[shell->num_children];
+        int k;
+        for (k = 0; k < shell->num_children; k++) {
+            // without a pidfd, the command is waited for alone
+            if (shell->children[k].pidfd == -1) {
+                pid_t pid = wait4(shell->children[k].pid, status, options & WNOHANG, usage);
+                if (pid == 0) {
+                    return 0;
+                }
+                if (pid > 0 || errno != EINTR) {
+                    remove_child(k);
+                }
+                if (pid > 0) {
+                    return pid;
+                }
+                break;
+            }
+            fds[k].fd = shell->children[k].pidfd;
+            fds[k].events = POLLIN;
+            fds[k].revents = 0;
+        }
+        if (k < shell->num_children) {
+            continue;
+        }
+        int ready = poll(fds, shell->num_children, (options & WNOHANG) ? 0 : -1);
+        if (ready == 0) {
+            return 0;
+        }
+        for (k = 0; ready > 0 && k < shell->num_children; k++) {
+            if (fds[k].revents == 0) {
+                continue;
+            }
+            pid_t pid = wait4(shell->children[k].pid, status, WNOHANG, usage);
+            if (pid != 0) {
+                // -1 if something else has waited for it, the status is lost
+                remove_child(k);
+                if (pid > 0) {
+                    return pid;
+                }
+                break;
+            }
+        }
+    }
+    errno = ECHILD;
+    return -1;
+}
+
+/*
+ *  Function:  add_child
+ *  --------------------
+ *  adds a command the shell has forked to the ones wait_local waits for
+ * 
+ *  pid: pid of the command
+ */
+void add_child(pid_t pid) {
+    shell->children = realloc(shell->children, (shell->num_children + 1) * sizeof(struct child));
+    if (!shell->children) {
+        write_error();
+        exit(1);
+    }
+    shell->children[shell->num_children].pid = pid;
+    shell->children[shell->num_children].pidfd = syscall(SYS_pidfd_open, pid, 0);
+    shell->num_children++;
+}
+
+/*
+ *  Function:  remove_child
+ *  --------------------
+ *  removes a command that has been waited for from the children of the shell
+ * 
+ *  k: index of the command in children
+ */
+void remove_child(int k) {
+    if (shell->children[k].pidfd != -1) {
+        close(shell->children[k].pidfd);
+    }
+    shell->num_children--;
+    memmove(shell->children + k, shell->children + k + 1, (shell->num_children - k) * sizeof(struct child));
+}
+
+/*
+ *  Function:  wait_spawn
+ *  --------------------
+ *  waits for a command started by the --spawn-server helper. the status comes from the
+ *  helper, which is the parent of the commands
+ * 
+ *  status: set to the status of the command
+ *  usage: set to the resources used by the command
+ *  options: WNOHANG to return 0 at once if no command has finished
+ * 
+ *  returns: pid of the command, 0 with WNOHANG if none has finished, -1 if the helper
+ *           has gone away
+ */
+pid_t wait_spawn(int* status, struct rusage* usage, int options) {
+    while (1) {
+        struct spawn_reply reply;
+        ssize_t n = recv(spawn_fd, &reply, sizeof(reply), (options & WNOHANG) ? MSG_DONTWAIT : 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (n != sizeof(reply)) {
+            spawn_close();
+            return -1;
+        }
+        if (reply.type == SPAWN_EXITED) {
+            *status = reply.status;
+            *usage = reply.usage;
+            return reply.pid;
+        }
+    }
+}
+
+/*
+ *  Function:  kill_group
+ *  --------------------
+ *  sends a signal to the process group of the commands of the line, the kill of the
+ *  local and --spawn-server backends
+ * 
+ *  sig: the signal
+ */
+void kill_group(int sig) {
+    if (shell->line_pgid > 0) {
+        killpg(shell->line_pgid, sig);
+    }
+}
+
+/*
+ *  Function:  spawn_close
+ *  --------------------
+ *  closes the socket to the --spawn-server helper, after which the shell forks the
+ *  commands itself
+ */
+void spawn_close() {
+    close(spawn_fd);
+    spawn_fd = -1;
+    backend = &local_backend;
+}
+
+/*
+ *  Function:  add_exit
+ *  --------------------
+ *  keeps a command a backend reported finished for the next wait_cmd
+ * 
+ *  pid: pid of the command
+ *  status: its status, as returned by wait4
+ *  usage: the resources it used, NULL if unknown
+ */
+void add_exit(pid_t pid, int status, struct rusage* usage) {
+    struct spawn_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = SPAWN_EXITED;
+    reply.pid = pid;
+    reply.status = status;
+    if (usage != NULL) {
+        reply.usage = *usage;
+    }
+    spawn_exits = realloc(spawn_exits, (num_spawn_exits + 1) * sizeof(struct spawn_reply));
+    spawn_exits[num_spawn_exits++] = reply;
+}
+
+/*
+ *  Function:  pack_request
+ *  --------------------
+ *  writes the spawn_request of a job followed by its argv, path and semaphore name
+ * 
+ *  job: the job of the command
+ *  path: the path the command is searched in
+ *  buf: where the request is written
+ *  size: bytes of buf
+ * 
+ *  returns: bytes written, 0 if the strings do not fit
+ */
+size_t pack_request(struct job* job, char** path, char* buf, size_t size) {
+    struct spawn_request* req = (struct spawn_request*)buf;
+    memset(req, 0, sizeof(*req));
+    req->redirection = job->redirection;
+    req->has_cpus = job->has_cpus;
+    req->cpus = job->cpus;
+    req->limit_set = job->limit_set;
+    memcpy(req->limits, job->limits, sizeof(req->limits));
+    req->has_nice = job->has_nice;
+    req->nice = job->nice;
+    req->ioprio = job->ioprio;
+    req->sem_slots = job->sem_slots;
+    req->pgid = shell->line_pgid;
+    req->owns_terminal = owns_terminal;
+    req->num_args = count_tokens(job->argv);
+    req->num_path = count_tokens(path);
+    req->has_sem = job->sem_name != NULL;
+    req->has_dir = job->dir_fd != -1;
+    req->has_report = shell->report_fds[1] != -1;
+
+    size_t len = sizeof(struct spawn_request);
+    int k;
+    for (k = 0; k < req->num_args + req->num_path + req->has_sem; k++) {
+        char* str = k < req->num_args ? job->argv[k] :
+                    k < req->num_args + req->num_path ? path[k - req->num_args] : job->sem_name;
+        size_t str_len = strlen(str) + 1;
+        if (len + str_len > size) {
+            return 0;
+        }
+        memcpy(buf + len, str, str_len);
+        len += str_len;
+    }
+    return len;
+}
+
+/*
+ *  Function:  unpack_request
+ *  --------------------
+ *  rebuilds a job and its path from a spawn_request and the strings after it
+ * 
+ *  req: the request
+ *  job: set to the job, without a directory
+ *  argv: set to the argv of the job, room for req->num_args + 1 strings
+ *  path: set to the path of the job, room for req->num_path + 1 strings
+ * 
+ *  returns: the first byte after the strings
+ */
+char* unpack_request(struct spawn_request* req, struct job* job, char** argv, char** path) {
+    memset(job, 0, sizeof(*job));
+    char* str = (char*)req + sizeof(struct spawn_request);
+    int k;
+    for (k = 0; k < req->num_args; k++) {
+        argv[k] = str;
+        str += strlen(str) + 1;
+    }
+    argv[req->num_args] = NULL;
+    for (k = 0; k < req->num_path; k++) {
+        path[k] = str;
+        str += strlen(str) + 1;
+    }
+    path[req->num_path] = NULL;
+    job->argv = argv;
+    job->redirection = req->redirection;
+    job->has_cpus = req->has_cpus;
+    job->cpus = req->cpus;
+    job->limit_set = req->limit_set;
+    memcpy(job->limits, req->limits, sizeof(job->limits));
+    job->has_nice = req->has_nice;
+    job->nice = req->nice;
+    job->ioprio = req->ioprio;
+    job->sem_slots = req->sem_slots;
+    if (req->has_sem) {
+        job->sem_name = str;
+        str += strlen(str) + 1;
+    }
+    job->dir_fd = -1;
+    return str;
+}
+
+/*
+ *  Function:  start_workers
+ *  --------------------
+ *  --workers=N forks N local workers, each listening on an abstract Unix socket named
+ *  after the shell, which stand in for other machines and are killed when the shell
+ *  exits. --workers=SOCKET,... uses running workers (dash --worker SOCKET) instead.
+ *  the shell then connects to them (see connect_workers)
+ */
+void start_workers() {
+    char* end;
+    long num = strtol(shell->opt.workers, &end, 10);
+    if (*end != '\0') {
+        char* names = strdup(shell->opt.workers);
+        char* name = strtok(names, ",");
+        while (name != NULL) {
+            add_worker(name);
+            name = strtok(NULL, ",");
+        }
+    }
+    int k;
+    for (k = 0; *end == '\0' && k < num; k++) {
+        char name[64];
+        snprintf(name, sizeof(name), "@dash-%d-worker-%d", getpid(), k);
+        // listening before the fork, so the shell can connect at once
+        int listen_fd = worker_listen(name);
+        if (listen_fd == -1) {
+            write_error();
+            continue;
+        }
+        pid_t parent = getpid();
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != parent) {
+                _exit(0);
+            }
+            // --jobs of the shell is not the number of slots of the worker
+            shell->opt.max_jobs = 0;
+            worker_daemon(listen_fd);
+        }
+        close(listen_fd);
+        if (pid < 0) {
+            write_error();
+            continue;
+        }
+        add_worker(strdup(name));
+    }
+    connect_workers();
+}
+
+/*
+ *  Function:  add_worker
+ *  --------------------
+ *  adds a worker the shell sends commands to
+ * 
+ *  name: socket of the worker
+ */
+void add_worker(char* name) {
+    workers = realloc(workers, (num_workers + 1) * sizeof(struct worker));
+    workers[num_workers].name = name;
+    workers[num_workers].fd = -1;
+    workers[num_workers].slots = 1;
+    workers[num_workers].queued = 0;
+    workers[num_workers].ids = NULL;
+    num_workers++;
+}
+
+/*
+ *  Function:  worker_addr
+ *  --------------------
+ *  fills in the address of a worker socket. a name starting with @ is in the abstract
+ *  namespace of Linux, which needs no file
+ * 
+ *  name: the socket
+ *  addr: set to its address
+ * 
+ *  returns: length of the address, -1 if the name is empty or too long
+ */
+int worker_addr(char* name, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    size_t len = strlen(name);
+    if (len == 0 || len >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    memcpy(addr->sun_path, name, len);
+    if (name[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return sizeof(sa_family_t) + len;
+    }
+    return sizeof(*addr);
+}
+
+/*
+ *  Function:  worker_listen
+ *  --------------------
+ *  opens the listening socket of a worker, replacing the file if it exists
+ * 
+ *  name: the socket
+ * 
+ *  returns: the socket, -1 on an error
+ */
+int worker_listen(char* name) {
+    struct sockaddr_un addr;
+    int addr_len = worker_addr(name, &addr);
+    int fd = addr_len == -1 ? -1 : socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (name[0] != '@') {
+        unlink(name);
+    }
+    if (bind(fd, (struct sockaddr*)&addr, addr_len) == -1 || listen(fd, 64) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ *  Function:  worker_daemon
+ *  --------------------
+ *  --worker: main loop of a worker. every shell that connects is served by a process
+ *  forked for it (see worker_serve). does not return
+ * 
+ *  listen_fd: the listening socket of the worker
+ */
+void worker_daemon(int listen_fd) {
+    // the paths come with the commands, the directories of the shell's would get stale
+    close_path_dirs(shell);
+    // Ctrl-C is for the shell, which sends it to its commands with WORKER_KILL
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    // the processes serving shells are not waited for
+    signal(SIGCHLD, SIG_IGN);
+    while (1) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            worker_serve(conn);
+        }
+        close(conn);
+    }
+}
+
+/*
+ *  Function:  worker_serve
+ *  --------------------
+ *  runs the commands 1 shell gives a worker, at most slots (the number of CPUs, or
+ *  --jobs) at once and the others in the order they came. every command has its own
+ *  process group, /dev/null as standard input and pipes as standard output and error.
+ *  what it writes is sent to the shell as it comes, then its status once it has exited.
+ *  the commands are killed when the shell goes away. does not return
+ * 
+ *  conn: the connection to the shell
+ */
+void worker_serve(int conn) {
+    signal(SIGCHLD, SIG_DFL);
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+    if (sfd == -1) {
+        _exit(1);
+    }
+    jobs_sem = NULL;
+    struct worker_msg hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.type = WORKER_HELLO;
+    hello.value = shell->opt.max_jobs > 0 ? shell->opt.max_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    int slots = hello.value > 0 ? hello.value : 1;
+    send(conn, &hello, sizeof(hello), MSG_NOSIGNAL);
+
+    static char buf[sizeof(struct worker_msg) + SPAWN_MSG_MAX];
+    struct worker_msg* msg = (struct worker_msg*)buf;
+    struct worker_cmd* cmds = NULL;
+    int num_cmds = 0;
+    while (1) {
+        // start the commands that get a slot
+        int running = 0;
+        int k;
+        for (k = 0; k < num_cmds; k++) {
+            running += cmds[k].pid > 0 && cmds[k].status == -1;
+        }
+        for (k = 0; k < num_cmds && running < slots; k++) {
+            if (cmds[k].request != NULL) {
+                worker_run(&cmds[k]);
+                running += cmds[k].pid > 0;
+            }
+        }
+        // answer for the commands that have exited once all of their output is sent
+        k = 0;
+        while (k < num_cmds) {
+            if (cmds[k].status == -1 || cmds[k].out != -1 || cmds[k].err != -1) {
+                k++;
+                continue;
+            }
+            memset(msg, 0, sizeof(*msg));
+            msg->type = WORKER_EXITED;
+            msg->id = cmds[k].id;
+            msg->value = cmds[k].status;
+            msg->usage = cmds[k].usage;
+            send(conn, msg, sizeof(*msg), MSG_NOSIGNAL);
+            num_cmds--;
+            memmove(&cmds[k], &cmds[k + 1], (num_cmds - k) * sizeof(struct worker_cmd));
+        }
+
+        struct pollfd fds[2 + 2 * num_cmds];
+        fds[0] = (struct pollfd){conn, POLLIN, 0};
+        fds[1] = (struct pollfd){sfd, POLLIN, 0};
+        for (k = 0; k < num_cmds; k++) {
+            fds[2 + 2 * k] = (struct pollfd){cmds[k].out, POLLIN, 0};
+            fds[3 + 2 * k] = (struct pollfd){cmds[k].err, POLLIN, 0};
+        }
+        if (poll(fds, 2 + 2 * num_cmds, -1) == -1) {
+            continue;
+        }
+        // send what the commands wrote
+        for (k = 0; k < 2 * num_cmds; k++) {
+            if (!(fds[2 + k].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+            int* pipe_fd = k % 2 == 0 ? &cmds[k / 2].out : &cmds[k / 2].err;
+            ssize_t n = read(*pipe_fd, buf + sizeof(*msg), SPAWN_MSG_MAX);
+            if (n > 0) {
+                memset(msg, 0, sizeof(*msg));
+                msg->type = WORKER_OUTPUT;
+                msg->id = cmds[k / 2].id;
+                msg->value = k % 2 + 1;
+                send(conn, buf, sizeof(*msg) + n, MSG_NOSIGNAL);
+            }
+            else if (n == 0 || errno != EINTR) {
+                close(*pipe_fd);
+                *pipe_fd = -1;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sfd, &info, sizeof(info)) == sizeof(info)) {
+                int status;
+                struct rusage usage;
+                pid_t pid;
+                while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+                    for (k = 0; k < num_cmds; k++) {
+                        if (cmds[k].pid == pid) {
+                            cmds[k].status = status;
+                            cmds[k].usage = usage;
+                        }
+                    }
+                }
+            }
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP))) {
+            continue;
+        }
+        ssize_t len = recv(conn, buf, sizeof(buf), 0);
+        // the shell has gone away, and so do its commands
+        if (len == 0 || (len == -1 && errno != EINTR)) {
+            for (k = 0; k < num_cmds; k++) {
+                if (cmds[k].pid > 0 && cmds[k].status == -1) {
+                    killpg(cmds[k].pid, SIGKILL);
+                }
+            }
+            _exit(0);
+        }
+        if (len < (ssize_t)sizeof(*msg)) {
+            continue;
+        }
+        if (msg->type == WORKER_RUN && len > (ssize_t)(sizeof(*msg) + sizeof(struct spawn_request))) {
+            cmds = realloc(cmds, (num_cmds + 1) * sizeof(struct worker_cmd));
+            memset(&cmds[num_cmds], 0, sizeof(struct worker_cmd));
+            cmds[num_cmds].id = msg->id;
+            cmds[num_cmds].request = malloc(len);
+            memcpy(cmds[num_cmds].request, buf, len);
+            cmds[num_cmds].out = -1;
+            cmds[num_cmds].err = -1;
+            cmds[num_cmds].status = -1;
+            num_cmds++;
+        }
+        // commands that have not started yet end as if the signal had killed them
+        else if (msg->type == WORKER_KILL) {
+            for (k = 0; k < num_cmds; k++) {
+                if (cmds[k].pid > 0 && cmds[k].status == -1) {
+                    killpg(cmds[k].pid, msg->value);
+                }
+                else if (cmds[k].request != NULL) {
+                    free(cmds[k].request);
+                    cmds[k].request = NULL;
+                    cmds[k].status = msg->value;
+                }
+            }
+        }
+    }
+}
+
+/*
+ *  Function:  worker_run
+ *  --------------------
+ *  starts a command a worker was given (see worker_serve), in the directory it has
+ *  in the shell. a command that cannot be started exits with 1
+ * 
+ *  cmd: the command, its request is freed
+ */
+void worker_run(struct worker_cmd* cmd) {
+    int out[2] = {-1, -1};
+    int err[2] = {-1, -1};
+    cmd->pid = -1;
+    if (pipe2(out, O_CLOEXEC) == 0 && pipe2(err, O_CLOEXEC) == 0) {
+        cmd->pid = fork();
+    }
+    if (cmd->pid == 0) {
+        struct spawn_request* req = (struct spawn_request*)(cmd->request + sizeof(struct worker_msg));
+        struct job job;
+        char* argv[req->num_args + 1];
+        char* path[req->num_path + 1];
+        char* cwd = unpack_request(req, &job, argv, path);
+        int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        if (chdir(cwd) == -1) {
+            write_error();
+            _exit(1);
+        }
+        // every command is the leader of its own group (see join_group)
+        shell->line_pgid = 0;
+        owns_terminal = 0;
+        exec_child(&job, path, 1);
+    }
+    free(cmd->request);
+    cmd->request = NULL;
+    int k;
+    for (k = 0; k < 2; k++) {
+        if (out[k] != -1 && (k == 1 || cmd->pid < 0)) {
+            close(out[k]);
+        }
+        if (err[k] != -1 && (k == 1 || cmd->pid < 0)) {
+            close(err[k]);
+        }
+    }
+    if (cmd->pid < 0) {
+        cmd->status = 1 << 8;
+        return;
+    }
+    setpgid(cmd->pid, cmd->pid);
+    cmd->out = out[0];
+    cmd->err = err[0];
+}
+
+/*
+ *  Function:  connect_workers
+ *  --------------------
+ *  connects to every worker. a forked shell calls it again to have connections of its
+ *  own (see worker_start). the shell forks the commands itself if no worker answers
+ */
+void connect_workers() {
+    workers_owner = getpid();
+    int connected = 0;
+    int k;
+    for (k = 0; k < num_workers; k++) {
+        if (workers[k].fd != -1) {
+            close(workers[k].fd);
+        }
+        workers[k].queued = 0;
+        workers[k].fd = connect_worker(workers[k].name, &workers[k].slots);
+        if (workers[k].fd == -1) {
+            write_error();
+        }
+        else {
+            connected++;
+        }
+    }
+    backend = connected > 0 ? &worker_backend : &local_backend;
+}
+
+/*
+ *  Function:  connect_worker
+ *  --------------------
+ *  connects to 1 worker and reads its hello
+ * 
+ *  name: socket of the worker
+ *  slots: set to the number of commands the worker runs at once
+ * 
+ *  returns: the connection, -1 on an error
+ */
+int connect_worker(char* name, int* slots) {
+    struct sockaddr_un addr;
+    int addr_len = worker_addr(name, &addr);
+    int fd = addr_len == -1 ? -1 : socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct worker_msg hello;
+    if (connect(fd, (struct sockaddr*)&addr, addr_len) == -1 ||
+        recv(fd, &hello, sizeof(hello), 0) != sizeof(hello) || hello.type != WORKER_HELLO) {
+        close(fd);
+        return -1;
+    }
+    *slots = hello.value > 0 ? hello.value : 1;
+    return fd;
+}
+
+/*
+ *  Function:  worker_start
+ *  --------------------
+ *  sends a command to the worker with the shortest queue for its slots, the start of
+ *  the worker backend. the command gets an id above every pid, which is used as its pid
+ *  in the shell. if the worker has gone away, the next one is tried
+ * 
+ *  job: the job of the command
+ *  path: the path the command is searched in
+ * 
+ *  returns: id of the command, -1 with errno set if it was not sent
+ */
+pid_t worker_start(struct job* job, char** path) {
+    // the connections of the parent of a forked shell are not its own
+    if (workers_owner != getpid()) {
+        connect_workers();
+        if (backend != &worker_backend) {
+            return -1;
+        }
+    }
+    int best = -1;
+    int k;
+    for (k = 0; k < num_workers; k++) {
+        if (workers[k].fd != -1 && (best == -1 ||
+            (long)workers[k].queued * workers[best].slots < (long)workers[best].queued * workers[k].slots)) {
+            best = k;
+        }
+    }
+    if (best == -1) {
+        backend = &local_backend;
+        return -1;
+    }
+
+    static char buf[sizeof(struct worker_msg) + SPAWN_MSG_MAX];
+    struct worker_msg* msg = (struct worker_msg*)buf;
+    memset(msg, 0, sizeof(*msg));
+    msg->type = WORKER_RUN;
+    worker_ids = worker_ids < INT_MAX ? worker_ids + 1 : WORKER_IDS + 1;
+    msg->id = worker_ids;
+    // the directory of the command follows the request
+    size_t len = pack_request(job, path, buf + sizeof(*msg), SPAWN_MSG_MAX - PATH_MAX);
+    char* cwd = buf + sizeof(*msg) + len;
+    if (len == 0 || dir_name(job->dir_fd, cwd, PATH_MAX) == -1) {
+        write_error();
+        errno = E2BIG;
+        return -1;
+    }
+    len += sizeof(*msg) + strlen(cwd) + 1;
+    // output written by the shell so far comes before the command's
+    fflush(stdout);
+    ssize_t sent;
+    while ((sent = send(workers[best].fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1 &&
+           (errno == EINTR || errno == EAGAIN)) {
+        // the worker may be waiting for the shell to read the output of its commands
+        struct pollfd fds = {workers[best].fd, POLLIN | POLLOUT, 0};
+        if (poll(&fds, 1, -1) > 0 && (fds.revents & POLLIN)) {
+            int status;
+            struct rusage usage;
+            pid_t pid = worker_read(best, &status, &usage);
+            if (pid > 0) {
+                add_exit(pid, status, &usage);
+            }
+            if (pid == -1) {
+                break;
+            }
+        }
+    }
+    if (sent == -1) {
+        if (workers[best].fd != -1) {
+            worker_lost(best);
+        }
+        return backend == &worker_backend ? worker_start(job, path) : -1;
+    }
+    workers[best].ids = realloc(workers[best].ids, (workers[best].queued + 1) * sizeof(int));
+    workers[best].ids[workers[best].queued++] = worker_ids;
+    return worker_ids;
+}
+
+/*
+ *  Function:  dir_name
+ *  --------------------
+ *  gets the name of the directory a command runs in
+ * 
+ *  dir_fd: descriptor of the directory (see scope_dirs), -1 for the shell's
+ *  buf: set to the name
+ *  size: bytes of buf
+ * 
+ *  returns: 0 on success, -1 on an error
+ */
+int dir_name(int dir_fd, char* buf, size_t size) {
+    if (dir_fd == -1) {
+        return getcwd(buf, size) != NULL ? 0 : -1;
+    }
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    ssize_t len = readlink(link, buf, size - 1);
+    if (len == -1) {
+        return -1;
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+/*
+ *  Function:  worker_read
+ *  --------------------
+ *  reads 1 message from a worker. output of a command is written to the standard
+ *  output or error of the shell
+ * 
+ *  k: index of the worker
+ *  status: set to the status of a command that has finished
+ *  usage: set to the resources it used
+ * 
+ *  returns: id of a command that has finished, 0 for any other message, -1 if the
+ *           worker has gone away
+ */
+pid_t worker_read(int k, int* status, struct rusage* usage) {
+    static char buf[sizeof(struct worker_msg) + SPAWN_MSG_MAX];
+    struct worker_msg* msg = (struct worker_msg*)buf;
+    ssize_t n = recv(workers[k].fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n < (ssize_t)sizeof(*msg)) {
+        worker_lost(k);
+        return -1;
+    }
+    if (msg->type == WORKER_OUTPUT) {
+        char* data = buf + sizeof(*msg);
+        n -= sizeof(*msg);
+        while (n > 0) {
+            ssize_t written = write(msg->value == 2 ? STDERR_FILENO : STDOUT_FILENO, data, n);
+            if (written == -1 && errno != EINTR) {
+                break;
+            }
+            if (written > 0) {
+                data += written;
+                n -= written;
+            }
+        }
+        return 0;
+    }
+    if (msg->type != WORKER_EXITED) {
+        return 0;
+    }
+    int j;
+    for (j = 0; j < workers[k].queued && workers[k].ids[j] != msg->id; j++);
+    if (j == workers[k].queued) {
+        return 0;
+    }
+    workers[k].queued--;
+    memmove(&workers[k].ids[j], &workers[k].ids[j + 1], (workers[k].queued - j) * sizeof(int));
+    *status = msg->value;
+    *usage = msg->usage;
+    return msg->id;
+}
+
+/*
+ *  Function:  worker_lost
+ *  --------------------
+ *  closes the connection to a worker that has gone away. its commands end with status
+ *  1, and the shell forks the commands itself once no worker is left
+ * 
+ *  k: index of the worker
+ */
+void worker_lost(int k) {
+    write_error();
+    close(workers[k].fd);
+    workers[k].fd = -1;
+    int j;
+    for (j = 0; j < workers[k].queued; j++) {
+        add_exit(workers[k].ids[j], 1 << 8, NULL);
+    }
+    workers[k].queued = 0;
+    for (j = 0; j < num_workers && workers[j].fd == -1; j++);
+    if (j == num_workers) {
+        backend = &local_backend;
+    }
+}
+
+/*
+ *  Function:  worker_wait
+ *  --------------------
+ *  waits for a command given to a worker to finish, the wait of the worker backend.
+ *  output the commands write in the meantime is written by the shell
+ * 
+ *  status: set to the status of the command
+ *  usage: set to the resources used by the command
+ *  options: WNOHANG to return 0 at once if no command has finished
+ * 
+ *  returns: id of the command, 0 with WNOHANG if none has finished, -1 if there is
+ *           no command to wait for
+ */
+pid_t worker_wait(int* status, struct rusage* usage, int options) {
+    // a forked shell has not given the workers anything yet
+    if (workers_owner != getpid()) {
+        return -1;
+    }
+    while (1) {
+        struct pollfd fds[num_workers];
+        int queued = 0;
+        int k;
+        for (k = 0; k < num_workers; k++) {
+            fds[k] = (struct pollfd){workers[k].queued > 0 ? workers[k].fd : -1, POLLIN, 0};
+            queued += workers[k].queued;
+        }
+        if (queued == 0) {
+            return -1;
+        }
+        if (poll(fds, num_workers, (options & WNOHANG) ? 0 : -1) == 0) {
+            return 0;
+        }
+        for (k = 0; k < num_workers; k++) {
+            if (fds[k].revents == 0) {
+                continue;
+            }
+            pid_t pid = worker_read(k, status, usage);
+            if (pid > 0) {
+                return pid;
+            }
+            // the commands of a worker that has gone away are waiting in wait_cmd
+            if (pid == -1) {
+                return wait_cmd(status, usage, options);
+            }
+        }
+    }
+}
+
+/*
+ *  Function:  worker_kill
+ *  --------------------
+ *  sends a signal to the commands the shell has given the workers, the kill of the
+ *  worker backend. runs in forward_signal
+ * 
+ *  sig: the signal
+ */
+void worker_kill(int sig) {
+    struct worker_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = WORKER_KILL;
+    msg.value = sig;
+    int k;
+    for (k = 0; k < num_workers && workers_owner == getpid(); k++) {
+        if (workers[k].fd != -1 && workers[k].queued > 0) {
+            send(workers[k].fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+    }
+}
+
+/*
+ *  Function:  serve
+ *  --------------------
+ *  --serve: listens on a Unix socket and runs the script of every client (see dashc.c)
+ *  in a shell forked for it, so clients do not pay for starting dash and each script
+ *  has its own directory, path and variables. many scripts run at the same time. when
+ *  a script has finished, its status and times are sent to its client. does not return
+ * 
+ *  sock_path: file name of the socket, replaced if it exists
+ *  ctx: the shell every script starts from
+ */
+void serve(char* sock_path, struct dash_ctx* ctx) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        write_error();
+        exit(1);
+    }
+    strcpy(addr.sun_path, sock_path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(sock_path);
+    if (sock == -1 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(sock, SOMAXCONN) == -1) {
+        write_error();
+        exit(1);
+    }
+    // finished scripts are noticed on a signalfd next to the socket
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd == -1) {
+        write_error();
+        exit(1);
+    }
+    fflush(stdout);
+
+    struct serve_client* clients = NULL;
+    int num_clients = 0;
+    while (1) {
+        struct pollfd fds[2] = {{sock, POLLIN, 0}, {sfd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sfd, &info, sizeof(info)) == sizeof(info)) {
+                continue;
+            }
+            int status;
+            struct rusage usage;
+            pid_t pid;
+            while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+                int k;
+                for (k = 0; k < num_clients && clients[k].pid != pid; k++) {
+                    continue;
+                }
+                if (k == num_clients) {
+                    continue;
+                }
+                struct serve_reply reply;
+                reply.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                reply.wall_ns = now_ns() - clients[k].start;
+                reply.user_us = usage.ru_utime.tv_sec * 1000000L + usage.ru_utime.tv_usec;
+                reply.system_us = usage.ru_stime.tv_sec * 1000000L + usage.ru_stime.tv_usec;
+                reply.max_rss = usage.ru_maxrss;
+                // a client that has gone away does not get its reply
+                send(clients[k].conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+                close(clients[k].conn);
+                clients[k] = clients[--num_clients];
+            }
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            continue;
+        }
+        long start = now_ns();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            close(sfd);
+            sigprocmask(SIG_UNBLOCK, &chld, NULL);
+            serve_script(conn, ctx);
+        }
+        if (pid < 0) {
+            close(conn);
+            continue;
+        }
+        clients = realloc(clients, (num_clients + 1) * sizeof(struct serve_client));
+        clients[num_clients].pid = pid;
+        clients[num_clients].conn = conn;
+        clients[num_clients].start = start;
+        num_clients++;
+    }
+}
+
+/*
+ *  Function:  serve_script
+ *  --------------------
+ *  runs in the shell forked for a --serve client: reads the request, takes over the
+ *  client's standard input, output and error, directory and environment, and runs the
+ *  script like a batch file. does not return
+ * 
+ *  conn: connection to the client
+ *  ctx: the shell
+ */
+void serve_script(int conn, struct dash_ctx* ctx) {
+    struct serve_request req;
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(req) || req.script_len < 0 || req.cwd_len <= 0 ||
+            req.env_len < 0) {
+        _exit(1);
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        _exit(1);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    int k;
+    for (k = 0; k < 3; k++) {
+        dup2(fds[k], k);
+        close(fds[k]);
+    }
+    char* data = malloc(req.script_len + req.cwd_len + req.env_len + 1);
+    if (!data || read_full(conn, data, req.script_len + req.cwd_len + req.env_len) == -1) {
+        write_error();
+        _exit(1);
+    }
+    char* script = data;
+    char* cwd = data + req.script_len;
+    char* env = cwd + req.cwd_len;
+    data[req.script_len + req.cwd_len + req.env_len] = '\0';
+    if (chdir(cwd) == -1) {
+        write_error();
+        _exit(1);
+    }
+    clearenv();
+    while (env < data + req.script_len + req.cwd_len + req.env_len) {
+        putenv(env);
+        env += strlen(env) + 1;
+    }
+    // nothing to run
+    if (req.script_len == 0) {
+        _exit(0);
+    }
+    FILE* input_file = fmemopen(script, req.script_len, "r");
+    if (!input_file) {
+        write_error();
+        _exit(1);
+    }
+    shell_pid = getpid();
+    init_state("");
+    init_signals(0);
+    run_stream(input_file, ctx);
+    exit(1);
+}
+
+/*
+ *  Function:  read_full
+ *  --------------------
+ *  reads exactly len bytes, since a socket may return less
+ * 
+ *  fd: file descriptor to read
+ *  buf: where the bytes go
+ *  len: bytes to read
+ * 
+ *  returns: 0 on success, -1 on an error or end of file
+ */
+int read_full(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*)buf + done, len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ *  Function:  dash_ctx_new
+ *  --------------------
+ *  creates a shell with /bin as its path, for main or a program using libdash
+ * 
+ *  returns: the shell, or NULL if there is no memory
+ */
+struct dash_ctx* dash_ctx_new() {
+    struct dash_ctx* ctx = calloc(1, sizeof(struct dash_ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->exit_not_called = 1;               // initialize exit as not called
+    ctx->path = malloc(2 * sizeof(char*));  // allocate memory for path variable
+    if (!ctx->path) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->path[0] = strdup("/bin");          // initialize initial shell path directory
+    ctx->path[1] = NULL;                    // the path is NULL terminated like the ones path makes
+    if (!ctx->path[0]) {
+        free(ctx->path);
+        free(ctx);
+        return NULL;
+    }
+    open_path_dirs(ctx, ctx->path);
+    ctx->opt.cache_size = 1L << 30;         // 1 GiB of cached results
+    ctx->opt.drain_timeout = -1;            // exit waits for every command of its line
+    ctx->journal_fd = -1;
+    ctx->report_fds[0] = -1;
+    ctx->report_fds[1] = -1;
+    return ctx;
+}
+
+/*
+ *  Function:  dash_ctx_free
+ *  --------------------
+ *  frees a shell made by dash_ctx_new
+ * 
+ *  ctx: the shell
+ */
+void dash_ctx_free(struct dash_ctx* ctx) {
+    int i;
+    for (i = 0; i < ctx->num_builtins; i++) {
+        free(ctx->builtins[i].name);
+    }
+    free(ctx->builtins);
+    free_path(ctx->path);
+    for (i = 0; i < ctx->num_pure_commands; i++) {
+        free(ctx->pure_commands[i]);
+    }
+    free(ctx->pure_commands);
+    close_path_dirs(ctx);
+    for (i = 0; i < ctx->num_children; i++) {
+        if (ctx->children[i].pidfd != -1) {
+            close(ctx->children[i].pidfd);
+        }
+    }
+    free(ctx->children);
+    free(ctx->machine_jobs);
+    free(ctx->cpu_order);
+    free(ctx->fresh_index);
+    free(ctx->finished);
+    if (shell == ctx) {
+        shell = NULL;
+    }
+    free(ctx);
+}
+
+/*
+ *  Function:  dash_eval
+ *  --------------------
+ *  runs 1 line in a shell, like a line typed at the dash> prompt
+ * 
+ *  ctx: the shell
+ *  line: the line, a trailing newline is not needed
+ *  result: set to the status and times of the line if not NULL
+ * 
+ *  returns: 0 if every command succeeded, otherwise the exit status of the last
+ *           command that failed (see process)
+ */
+int dash_eval(struct dash_ctx* ctx, const char* line, struct dash_result* result) {
+    char* input = strdup(line);     // process destroys the input
+    if (!input) {
+        write_error();
+        return 1;
+    }
+    // a built-in command registered by the program may run a line in another shell
+    struct dash_ctx* caller = shell;
+    shell = ctx;
+    ctx->no_exec = 1;   // exec would replace the program
+    long start = now_ns();
+    int status = process(input, ctx);
+    shell = caller;
+    free(input);
+    if (result != NULL) {
+        result->status = status;
+        result->wall_ns = now_ns() - start;
+        result->user_us = ctx->last_user_us;
+        result->system_us = ctx->last_system_us;
+        result->max_rss = ctx->last_max_rss;
+    }
+    return status;
+}
+
+/*
+ *  Function:  dash_register_builtin
+ *  --------------------
+ *  adds a built-in command to a shell, or replaces one added before with the same
+ *  name. it runs in the process of the shell, in line order with the other built-in
+ *  commands, and the commands between them start together as usual
+ * 
+ *  ctx: the shell
+ *  name: name of the command
+ *  fn: function called with the command and its arguments
+ *  data: given to fn
+ * 
+ *  returns: 0 on success, -1 if name is a built-in command of dash or there is no memory
+ */
+int dash_register_builtin(struct dash_ctx* ctx, const char* name, dash_builtin_fn fn, void* data) {
+    char* argv[2] = {(char*)name, NULL};
+    if (check_command(argv) == 1) {
+        return -1;
+    }
+    struct dash_builtin* builtin = find_builtin(ctx, (char*)name);
+    if (builtin == NULL) {
+        struct dash_builtin* builtins = realloc(ctx->builtins, (ctx->num_builtins + 1) * sizeof(struct dash_builtin));
+        if (!builtins) {
+            return -1;
+        }
+        ctx->builtins = builtins;
+        builtin = &ctx->builtins[ctx->num_builtins];
+        builtin->name = strdup(name);
+        if (!builtin->name) {
+            return -1;
+        }
+        ctx->num_builtins++;
+    }
+    builtin->fn = fn;
+    builtin->data = data;
+    return 0;
+}
+
+/*
+ *  Function:  dash_exit_called
+ *  --------------------
+ *  ctx: the shell
+ * 
+ *  returns: 1 once a line run in the shell has called the exit built-in command
+ */
+int dash_exit_called(struct dash_ctx* ctx) {
+    return !ctx->exit_not_called;
+}
+
+/*
+ *  Function:  run_machine
+ *  --------------------
+ *  --machine: reads 1 request per line of standard input, a JSON object such as
+ *      {"id": 7, "line": "ls -l > out & sleep 1"}
+ *  runs its line and writes 1 JSON object per request to standard output, in the order
+ *  of the requests:
+ *      {"id": 7, "status": 0, "error": null, "wall_us": 1003, "stdout": "", "stderr": "",
+ *       "jobs": [{"command": "ls -l > out", "pid": 4242, "status": 0, "error": null, ...}]}
+ *  the output of the line is captured into "stdout" and "stderr", and the commands read
+ *  /dev/null, so the requests can be sent without waiting for the answers. instead of
+ *  "An error has occurred", "error" is a code: syntax, redirect, usage, cd, fork,
+ *  not_found (status 127), exec (status 126), bad_request or error for any other. "id" is copied
+ *  from the request as it was written. exits at the end of the input or after exit
+ * 
+ *  ctx: the shell
+ */
+void run_machine(struct dash_ctx* ctx) {
+    char* request = NULL;
+    size_t bufsize = 0;
+    ctx->no_exec = 1;   // exec would replace the loop before it answers
+    int out = dup(STDOUT_FILENO);
+    int err = dup(STDERR_FILENO);
+    int in = dup(STDIN_FILENO);
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (out == -1 || err == -1 || in == -1 || null == -1) {
+        write_error();
+        exit(1);
+    }
+    while (ctx->exit_not_called && getline(&request, &bufsize, stdin) != -1) {
+        if (check_empty_input(request) == 1) {
+            continue;
+        }
+        char* id = NULL;
+        char* line = NULL;
+        if (parse_request(request, &id, &line) == -1) {
+            printf("{\"id\": %s, \"status\": 1, \"error\": \"bad_request\"}\n", id != NULL ? id : "null");
+            fflush(stdout);
+            free(id);
+            free(line);
+            continue;
+        }
+        shell->current_line++;
+
+        // the output of the line goes to 2 temporary files, read back into the answer
+        FILE* line_out = tmpfile();
+        FILE* line_err = tmpfile();
+        if (!line_out || !line_err) {
+            write_error();
+            exit(1);
+        }
+        fflush(stdout);
+        dup2(fileno(line_out), STDOUT_FILENO);
+        dup2(fileno(line_err), STDERR_FILENO);
+        dup2(null, STDIN_FILENO);
+        shell->line_error = NULL;
+        free(shell->machine_jobs);
+        shell->machine_jobs = NULL;
+        long start = now_ns();
+        int status = process(line, ctx);
+        long wall = now_ns() - start;
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        dup2(in, STDIN_FILENO);
+
+        printf("{\"id\": %s, \"status\": %d, \"error\": ", id != NULL ? id : "null", status);
+        if (shell->line_error != NULL) {
+            printf("\"%s\"", shell->line_error);
+        }
+        else {
+            printf("null");
+        }
+        printf(", \"wall_us\": %ld, \"stdout\": ", wall / 1000);
+        json_output(stdout, line_out);
+        printf(", \"stderr\": ");
+        json_output(stdout, line_err);
+        printf(", \"jobs\": %s}\n", shell->machine_jobs != NULL ? shell->machine_jobs : "[]");
+        fflush(stdout);
+        fclose(line_out);
+        fclose(line_err);
+        free(id);
+        free(line);
+    }
+    exit(0);
+}
+
+/*
+ *  Function:  parse_request
+ *  --------------------
+ *  parses a --machine request: a JSON object with an "id" of any type and a "line"
+ *  string. other members are ignored
+ * 
+ *  text: the request
+ *  id: set to the id as it was written (malloced), NULL if there is none
+ *  line: set to the decoded line (malloced), NULL if there is none
+ * 
+ *  returns: 0 on success, -1 if the request is not a JSON object with a line
+ */
+int parse_request(char* text, char** id, char** line) {
+    while (isspace(*text)) {
+        text++;
+    }
+    if (*text++ != '{') {
+        return -1;
+    }
+    while (1) {
+        while (isspace(*text) || *text == ',') {
+            text++;
+        }
+        if (*text == '}') {
+            break;
+        }
+        char* name = json_value(&text, 1);
+        while (isspace(*text)) {
+            text++;
+        }
+        if (name == NULL || *text++ != ':') {
+            free(name);
+            return -1;
+        }
+        while (isspace(*text)) {
+            text++;
+        }
+        char* value = json_value(&text, strcmp(name, "line") == 0);
+        if (value == NULL) {
+            free(name);
+            return -1;
+        }
+        if (strcmp(name, "id") == 0 && *id == NULL) {
+            *id = value;
+        }
+        else if (strcmp(name, "line") == 0 && *line == NULL) {
+            *line = value;
+        }
+        else {
+            free(value);
+        }
+        free(name);
+    }
+    return *line != NULL ? 0 : -1;
+}
+
+/*
+ *  Function:  json_value
+ *  --------------------
+ *  reads 1 JSON string, number or literal (objects and arrays are not used by
+ *  requests)
+ * 
+ *  text: pointer to the position in the request, moved past the value
+ *  decode: 1 to get the contents of a string with its escapes decoded, 0 to get the
+ *  value as it was written
+ * 
+ *  returns: the value (malloced), NULL if it is not valid
+ */
+char* json_value(char** text, int decode) {
+    char* start = *text;
+    char* p = start;
+    if (*p != '"') {
+        while (*p != '\0' && *p != ',' && *p != '}' && !isspace(*p)) {
+            p++;
+        }
+        if (p == start || decode) {
+            return NULL;
+        }
+        *text = p;
+        return strndup(start, p - start);
+    }
+    char* value = malloc(strlen(start) + 1);
+    int len = 0;
+    for (p++; *p != '"'; p++) {
+        if (*p == '\0' || *p == '\n') {
+            free(value);
+            return NULL;
+        }
+        if (*p != '\\') {
+            value[len++] = *p;
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'n': value[len++] = '\n'; break;
+            case 't': value[len++] = '\t'; break;
+            case 'r': value[len++] = '\r'; break;
+            case 'b': value[len++] = '\b'; break;
+            case 'f': value[len++] = '\f'; break;
+            case 'u': {
+                // exactly 4 hex digits, so p stays inside the request
+                unsigned int code = 0;
+                int k;
+                for (k = 1; k <= 4; k++) {
+                    if (!isxdigit((unsigned char)p[k])) {
+                        free(value);
+                        return NULL;
+                    }
+                    code = code * 16 + (isdigit((unsigned char)p[k]) ? p[k] - '0' : (tolower((unsigned char)p[k]) - 'a' + 10));
+                }
+                p += 4;
+                // UTF-8 (surrogate pairs are not combined)
+                if (code < 0x80) {
+                    value[len++] = code;
+                }
+                else if (code < 0x800) {
+                    value[len++] = 0xC0 | (code >> 6);
+                    value[len++] = 0x80 | (code & 0x3F);
+                }
+                else {
+                    value[len++] = 0xE0 | (code >> 12);
+                    value[len++] = 0x80 | ((code >> 6) & 0x3F);
+                    value[len++] = 0x80 | (code & 0x3F);
+                }
+                break;
+            }
+            case '\0':
+                free(value);
+                return NULL;
+            default: value[len++] = *p; break;     // \" \\ and \/
+        }
+    }
+    *text = p + 1;
+    if (!decode) {
+        free(value);
+        return strndup(start, p + 1 - start);
+    }
+    value[len] = '\0';
+    return value;
+}
+
+/*
+ *  Function:  json_string
+ *  --------------------
+ *  writes a JSON string
+ * 
+ *  out: where to write it
+ *  str: the characters
+ *  len: number of characters
+ */
+void json_string(FILE* out, char* str, size_t len) {
+    fputc('"', out);
+    size_t i;
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        }
+        else if (c == '\n') {
+            fprintf(out, "\\n");
+        }
+        else if (c == '\t') {
+            fprintf(out, "\\t");
+        }
+        else if (c < 0x20 || c == 0x7F) {
+            fprintf(out, "\\u%04x", c);
+        }
+        else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ *  Function:  json_output
+ *  --------------------
+ *  writes the contents of a file with captured output as a JSON string
+ * 
+ *  out: where to write it
+ *  file: the file
+ */
+void json_output(FILE* out, FILE* file) {
+    long len = lseek(fileno(file), 0, SEEK_END);
+    char* data = malloc(len > 0 ? len : 1);
+    if (len < 0 || pread(fileno(file), data, len, 0) != len) {
+        len = 0;
+    }
+    json_string(out, data, len);
+    free(data);
+}
+
+/*
+ *  Function:  machine_add
+ *  --------------------
+ *  adds the commands of a line to the JSON array of the --machine answer: command, pid
+ *  (null if it did not run), status, error code, and times in microseconds. a command
+ *  that exits with 127 was not found and one that exits with 126 could not be executed
+ * 
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ */
+void machine_add(struct job jobs[], int num_jobs) {
+    char* array = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&array, &size);
+    if (!out) {
+        return;
+    }
+    int count = 0;
+    int k;
+    for (k = 0; k < num_jobs; k++) {
+        struct job* job = &jobs[k];
+        if (job->argv == NULL || job->argv[0] == NULL) {
+            continue;
+        }
+        if (job->error == NULL && job->start > 0 && job->status == 127) {
+            job->error = "not_found";
+        }
+        else if (job->error == NULL && job->start > 0 && job->status == 126) {
+            job->error = "exec";
+        }
+        if (job->error != NULL && (shell->line_error == NULL || strcmp(shell->line_error, "error") == 0)) {
+            shell->line_error = job->error;
+        }
+        char* command = job_command(job);
+        fprintf(out, "%s{\"command\": ", count > 0 ? ", " : "");
+        json_string(out, command, strlen(command));
+        free(command);
+        if (job->start > 0 && job->pid > 0) {
+            fprintf(out, ", \"pid\": %d", job->pid);
+        }
+        else {
+            fprintf(out, ", \"pid\": null");
+        }
+        fprintf(out, ", \"status\": %d, \"error\": ", job->status);
+        if (job->error != NULL) {
+            fprintf(out, "\"%s\"", job->error);
+        }
+        else {
+            fprintf(out, "null");
+        }
+        long run = job->start > 0 && job->end > 0 ? job->end - job->start : 0;
+        fprintf(out, ", \"wait_us\": %ld, \"run_us\": %ld, \"user_us\": %ld, \"system_us\": %ld, \"max_rss_kb\": %ld}",
+                job->start > 0 ? (job->start - job->queued) / 1000 : 0, run / 1000, job->user_us,
+                job->system_us, job->max_rss);
+        count++;
+    }
+    fclose(out);
+    free(shell->machine_jobs);
+    shell->machine_jobs = malloc(size + 3);
+    sprintf(shell->machine_jobs, "[%s]", array);
+    free(array);
+}
+
+/*
+ *  Function:  can_tail_exec
+ *  --------------------
+ *  checks if a command of the last line of a batch file or -c string can replace the
+ *  shell with execve instead of being forked and waited for, which saves 1 process:
+ *  it is the only command of its line, nothing else is running, and no option has
+ *  something to record once it has finished. the shell then exits with its status
+ * 
+ *  ctx: the shell
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ *  k: index of the command
+ * 
+ *  returns: 1 if the command can replace the shell, 0 otherwise
+ */
+int can_tail_exec(struct dash_ctx* ctx, struct job jobs[], int num_jobs, int k) {
+    int i;
+    for (i = 0; i < num_jobs; i++) {
+        if (i != k && !jobs[i].skip) {
+            return 0;
+        }
+    }
+    if (ctx->running_jobs > 0 || jobs[k].cache || jobs[k].redirection < 0 || jobs[k].redirection > 1) {
+        return 0;
+    }
+    // results, timings and history are recorded after the command, --parallel needs
+    // the status of the batch file, --machine answers after every line, and
+    // --workers run the commands elsewhere
+    return !ctx->opt.report && ctx->opt.journal == NULL && !ctx->opt.incremental && !ctx->opt.progress && !ctx->opt.machine &&
+           !ctx->opt.parallel && ctx->opt.max_jobs == 0 && !ctx->opt.adaptive && ctx->opt.mem_budget == 0 &&
+           ctx->opt.cpu_policy == CPU_NONE && ctx->opt.workers == NULL;
+}
+
+/*
+ *  Function:  dash_exec
+ *  --------------------
+ *  built-in implementation of exec command. exec cmd args replaces the shell with the
+ *  command, with the directory, prefixes and redirection of its job. the commands
+ *  started before it on the line are waited for first. exec alone does nothing. a
+ *  program using libdash and the --machine loop are not replaced, exec is an error there
+ * 
+ *  ctx: the shell
+ *  arrTok: char** that has been tokenized
+ *  jobs[]: array of jobs on the line
+ *  num_jobs: the number of jobs
+ * 
+ *  returns: 1 if the shell cannot be replaced, 0 for exec alone
+ */
+int dash_exec(struct dash_ctx* ctx, char** arrTok, struct job jobs[], int num_jobs) {
+    if (arrTok[1] == NULL) {
+        return 0;
+    }
+    int k;
+    for (k = 0; k < num_jobs && jobs[k].argv != arrTok; k++) {
+        continue;
+    }
+    if (k == num_jobs || ctx->no_exec) {
+        if (k < num_jobs) {
+            jobs[k].error = "usage";
+        }
+        write_error();
+        return 1;
+    }
+    wait_for_cmds(jobs, num_jobs);
+    fflush(stdout);
+    // the command is the tokens after exec
+    jobs[k].argv = arrTok + 1;
+    exec_child(&jobs[k], jobs[k].path, 0);
+    return 1;   // exec_child does not return
+}
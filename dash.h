@@ -0,0 +1,65 @@
+/* Author: Ishwari Joshi
+   Interface of libdash, the parser and executor of dash as a library, and of dash --serve.
+   Build the library from dash.c with LIBDASH defined, which leaves out main:
+     gcc -c -fPIC -DLIBDASH -O dash.c -o libdash.o && ar rcs libdash.a libdash.o
+     gcc -shared -fPIC -fvisibility=hidden -DLIBDASH -O dash.c -o libdash.so
+*/
+
+#ifndef DASH_H
+#define DASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// functions exported by libdash.so, everything else in dash.c stays inside it
+#define DASH_API __attribute__((visibility("default")))
+
+/* a shell: its path, the result of its last line, whether exit was called, the
+built-in commands registered with dash_register_builtin and everything else its lines
+change. the directory of the shell is the directory of the process */
+struct dash_ctx;
+
+/* result of 1 line run by dash_eval */
+struct dash_result {
+    int status;         // 0 if every command succeeded, else the status of the last one that failed
+    long wall_ns;       // time the line took
+    long user_us;       // user CPU time of the commands in microseconds
+    long system_us;     // system CPU time of the commands in microseconds
+    long max_rss;       // largest peak resident set size of a command in kilobytes
+};
+
+/* a built-in command registered with dash_register_builtin. argv is the command and its
+arguments, NULL terminated, and data is the pointer given when it was registered.
+returns the status of the command */
+typedef int (*dash_builtin_fn)(struct dash_ctx* ctx, char** argv, void* data);
+
+DASH_API struct dash_ctx* dash_ctx_new();
+DASH_API void dash_ctx_free(struct dash_ctx* ctx);
+DASH_API int dash_eval(struct dash_ctx* ctx, const char* line, struct dash_result* result);
+DASH_API int dash_register_builtin(struct dash_ctx* ctx, const char* name, dash_builtin_fn fn, void* data);
+DASH_API int dash_exit_called(struct dash_ctx* ctx);
+
+/* request of a dash --serve client (see dashc.c). it is followed by the script, the
+directory to run it in and the environment (NUL separated strings), and carries the
+client's standard input, output and error as SCM_RIGHTS descriptors */
+struct serve_request {
+    int script_len;     // bytes of the script
+    int cwd_len;        // bytes of the directory, with its NUL
+    int env_len;        // bytes of the environment strings, with their NULs
+};
+
+/* answer to a dash --serve client once its script has finished */
+struct serve_reply {
+    int status;         // exit status dash would have had running the script
+    long wall_ns;       // time from the connection until the script finished
+    long user_us;       // user CPU time of the script and its commands in microseconds
+    long system_us;     // system CPU time of the script and its commands in microseconds
+    long max_rss;       // largest peak resident set size in kilobytes
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
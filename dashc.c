@@ -0,0 +1,282 @@
+/* Author: Ishwari Joshi
+   dashc is the client of dash --serve. It sends a batch file (or standard input) to a running
+   dash together with the current directory, the environment and its standard input, output and
+   error, waits for the script to finish, and exits with the status dash gives it.
+   Compile using "gcc dashc.c -o dashc -Wall -Werror -O" on a Unix system.
+
+   Usage: ./dashc [-t] SOCKET [batch.txt]
+          ./dashc -b N SOCKET batch.txt     (compares N runs through SOCKET with N runs of ./dash)
+*/
+
+/* include header files */
+#define _GNU_SOURCE     // for environ
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>     // for fork(), execl(), and getcwd()
+#include <sys/types.h>
+#include <sys/wait.h>   // for waitpid()
+#include <sys/socket.h> // for socket() and SCM_RIGHTS
+#include <sys/un.h>     // for struct sockaddr_un
+#include <fcntl.h>      // for open()
+#include <limits.h>     // for PATH_MAX
+#include <time.h>       // for clock_gettime()
+#include "dash.h"       // for struct serve_request and struct serve_reply
+
+/* function declarations */
+char* read_script(char* file_name, int* len);
+int run_remote(char* sock_path, char* script, int script_len, struct serve_reply* reply);
+int write_full(int fd, void* buf, size_t len);
+void bench(int runs, char* sock_path, char* file_name);
+long now_ns();
+void write_error();
+
+int main(int argc, char* argv[])
+{
+    int times = 0;      // -t: print the times dash sends back on standard error
+    int runs = 0;       // -b N: benchmark with N runs
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-t") == 0) {
+        times = 1;
+        i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "-b") == 0) {
+        runs = atoi(argv[i + 1]);
+        i += 2;
+        if (runs <= 0) {
+            write_error();
+            exit(1);
+        }
+    }
+    // a socket and at most 1 batch file (always 1 with -b)
+    if (argc - i < 1 || argc - i > 2 || (runs > 0 && argc - i != 2)) {
+        write_error();
+        exit(1);
+    }
+    if (runs > 0) {
+        bench(runs, argv[i], argv[i + 1]);
+        exit(0);
+    }
+
+    int script_len;
+    char* script = read_script(argc - i == 2 ? argv[i + 1] : NULL, &script_len);
+    struct serve_reply reply;
+    if (run_remote(argv[i], script, script_len, &reply) == -1) {
+        write_error();
+        exit(1);
+    }
+    if (times) {
+        fprintf(stderr, "status %d  wall %.3f ms  user %.3f ms  sys %.3f ms  maxrss %ld kB\n", reply.status,
+                reply.wall_ns / 1e6, reply.user_us / 1e3, reply.system_us / 1e3, reply.max_rss);
+    }
+    free(script);
+    return reply.status;
+}
+
+/*
+ *  Function:  read_script
+ *  --------------------
+ *  reads a whole batch file
+ *
+ *  file_name: the batch file, NULL for standard input
+ *  len: set to the number of bytes read
+ *
+ *  returns: the script (malloced), exits on an error
+ */
+char* read_script(char* file_name, int* len) {
+    int fd = file_name != NULL ? open(file_name, O_RDONLY) : STDIN_FILENO;
+    if (fd == -1) {
+        write_error();
+        exit(1);
+    }
+    int size = 4096;
+    char* script = malloc(size);
+    *len = 0;
+    ssize_t n;
+    while (script != NULL && (n = read(fd, script + *len, size - *len)) > 0) {
+        *len += n;
+        if (*len == size) {
+            size *= 2;
+            script = realloc(script, size);
+        }
+    }
+    if (script == NULL || n == -1) {
+        write_error();
+        exit(1);
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return script;
+}
+
+/*
+ *  Function:  run_remote
+ *  --------------------
+ *  runs a script in dash --serve with this process's directory, environment and
+ *  standard input, output and error, and waits for it to finish
+ *
+ *  sock_path: the socket dash listens on
+ *  script: the script
+ *  script_len: bytes of the script
+ *  reply: set to the answer of dash
+ *
+ *  returns: 0 on success, -1 if dash could not be reached
+ */
+int run_remote(char* sock_path, char* script, int script_len, struct serve_reply* reply) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        return -1;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        close(sock);
+        return -1;
+    }
+    struct serve_request req;
+    req.script_len = script_len;
+    req.cwd_len = strlen(cwd) + 1;
+    req.env_len = 0;
+    int k;
+    for (k = 0; environ[k] != NULL; k++) {
+        req.env_len += strlen(environ[k]) + 1;
+    }
+
+    // the request carries standard input, output and error
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    int failed = sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req) ||
+                 write_full(sock, script, script_len) == -1 ||
+                 write_full(sock, cwd, req.cwd_len) == -1;
+    for (k = 0; !failed && environ[k] != NULL; k++) {
+        failed = write_full(sock, environ[k], strlen(environ[k]) + 1) == -1;
+    }
+    if (failed || recv(sock, reply, sizeof(*reply), MSG_WAITALL) != sizeof(*reply)) {
+        close(sock);
+        return -1;
+    }
+    close(sock);
+    return 0;
+}
+
+/*
+ *  Function:  write_full
+ *  --------------------
+ *  writes exactly len bytes to a socket
+ *
+ *  fd: the socket
+ *  buf: the bytes
+ *  len: bytes to write
+ *
+ *  returns: 0 on success, -1 on an error
+ */
+int write_full(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = send(fd, (char*)buf + done, len - done, MSG_NOSIGNAL);
+        if (n == -1) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ *  Function:  bench
+ *  --------------------
+ *  runs a batch file N times through dash --serve, then N times by starting dash
+ *  (./dash, or the DASH environment variable) like a service calling it would, and
+ *  prints the runs per second of each. the output of the runs is thrown away
+ *
+ *  runs: N
+ *  sock_path: the socket dash listens on
+ *  file_name: the batch file
+ */
+void bench(int runs, char* sock_path, char* file_name) {
+    char* dash = getenv("DASH") != NULL ? getenv("DASH") : "./dash";
+    int script_len;
+    char* script = read_script(file_name, &script_len);
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (out == -1 || null == -1) {
+        write_error();
+        exit(1);
+    }
+    dup2(null, STDOUT_FILENO);
+
+    long start = now_ns();
+    int k;
+    for (k = 0; k < runs; k++) {
+        struct serve_reply reply;
+        if (run_remote(sock_path, script, script_len, &reply) == -1) {
+            write_error();
+            exit(1);
+        }
+    }
+    long served = now_ns() - start;
+
+    start = now_ns();
+    for (k = 0; k < runs; k++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl(dash, dash, file_name, (char*)NULL);
+            write_error();
+            _exit(1);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) == -1) {
+            write_error();
+            exit(1);
+        }
+    }
+    long execed = now_ns() - start;
+
+    dup2(out, STDOUT_FILENO);
+    printf("%d runs of %s\n", runs, file_name);
+    printf("  dash --serve   %10.1f runs/s  %8.3f ms/run\n", runs / (served / 1e9), served / 1e6 / runs);
+    printf("  fork+exec dash %10.1f runs/s  %8.3f ms/run\n", runs / (execed / 1e9), execed / 1e6 / runs);
+    free(script);
+}
+
+/*
+ *  Function:  now_ns
+ *  --------------------
+ *  returns: the monotonic clock in nanoseconds
+ */
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ *  Function:  write_error
+ *  --------------------
+ *  writes an error when an error of any type is encountered
+ */
+void write_error() {
+    char error_message[30] = "An error has occurred\n";
+    write(STDERR_FILENO, error_message, strlen(error_message));
+}